@@ -28,6 +28,8 @@
 #include <sys/param.h>
 
 #include <sys/acl.h>
+#include <sys/counter.h>
+#include <sys/epoch.h>
 #include <sys/fcntl.h>
 #include <sys/imgact.h>
 #include <sys/jail.h>
@@ -42,11 +44,14 @@
 #include <sys/priv.h>
 #include <sys/proc.h>
 #include <sys/queue.h>
+#include <sys/refcount.h>
 #include <sys/sx.h>
 #include <sys/stat.h>
+#include <sys/smp.h>
 #include <sys/sysctl.h>
 #include <sys/syslog.h>
 #include <sys/systm.h>
+#include <sys/taskqueue.h>
 #include <sys/uio.h>
 #include <sys/vnode.h>
 
@@ -56,7 +61,9 @@
 #else
 #include <crypto/sha2/sha2.h>
 #endif
+#include <fs/nullfs/null.h>
 #include <security/mac/mac_policy.h>
+#include <vm/uma.h>
 
 #include "secadm.h"
 
@@ -70,133 +77,858 @@ SYSCTL_NODE(_hardening_secadm, OID_AUTO, integriforce_so,
     CTLFLAG_MPSAFE | CTLFLAG_RW | CTLFLAG_PRISON | CTLFLAG_ANYBODY, sysctl_integriforce_so,
     "secadm integriforce checking for shared objects");
 
-int
-do_integriforce_check(secadm_rule_t *rule, struct vattr *vap,
-    struct vnode *vp, struct ucred *ucred)
+/*
+ * The digests a rule can name.  SHA-1 and SHA-256 go through the
+ * kernel's generic implementations; only arm64 picks an accelerated
+ * SHA-256 block transform there.  BLAKE3 is our own, in secadm_blake3.c.
+ */
+union integriforce_ctx {
+	SHA1_CTX		 sha1;
+	SHA256_CTX		 sha256;
+	secadm_blake3_ctx_t	 blake3;
+};
+
+static void
+integriforce_sha1_init(union integriforce_ctx *ctx)
 {
-	SHA256_CTX sha256ctx;
-	SHA1_CTX sha1ctx;
-	struct iovec iov;
-	struct uio uio;
-	unsigned char *buf, hash[SHA256_DIGEST_LENGTH];
-	size_t total, amt, hashsz;
-	int err;
 
-	switch (rule->sr_integriforce_data->si_cache) {
-	case 0:
-		break;
+	SHA1Init(&(ctx->sha1));
+}
 
-	case 1:
-		return (0);
+static void
+integriforce_sha1_update(union integriforce_ctx *ctx, const void *buf,
+    size_t len)
+{
 
-	default:
-		if (rule->sr_integriforce_data->si_mode == 0) {
-			printf("[SECADM] Warning: hash did not match for file"
-			       " (%s)\n", rule->sr_integriforce_data->si_path);
-			return (0);
+	SHA1Update(&(ctx->sha1), buf, len);
+}
+
+static void
+integriforce_sha1_final(union integriforce_ctx *ctx, unsigned char *hash)
+{
+
+	SHA1Final(hash, &(ctx->sha1));
+}
+
+static void
+integriforce_sha256_init(union integriforce_ctx *ctx)
+{
+
+	SHA256_Init(&(ctx->sha256));
+}
+
+static void
+integriforce_sha256_update(union integriforce_ctx *ctx, const void *buf,
+    size_t len)
+{
+
+	SHA256_Update(&(ctx->sha256), buf, len);
+}
+
+static void
+integriforce_sha256_final(union integriforce_ctx *ctx, unsigned char *hash)
+{
+
+	SHA256_Final(hash, &(ctx->sha256));
+}
+
+static void
+integriforce_blake3_init(union integriforce_ctx *ctx)
+{
+
+	secadm_blake3_init(&(ctx->blake3));
+}
+
+static void
+integriforce_blake3_update(union integriforce_ctx *ctx, const void *buf,
+    size_t len)
+{
+
+	secadm_blake3_update(&(ctx->blake3), buf, len);
+}
+
+static void
+integriforce_blake3_final(union integriforce_ctx *ctx, unsigned char *hash)
+{
+
+	secadm_blake3_final(&(ctx->blake3), hash);
+}
+
+static const struct integriforce_digest {
+	secadm_hash_type_t	 id_type;
+	size_t			 id_len;
+	void			(*id_init)(union integriforce_ctx *);
+	void			(*id_update)(union integriforce_ctx *,
+				    const void *, size_t);
+	void			(*id_final)(union integriforce_ctx *,
+				    unsigned char *);
+} integriforce_digests[] = {
+	{ secadm_hash_sha1, SHA1_RESULTLEN, integriforce_sha1_init,
+	    integriforce_sha1_update, integriforce_sha1_final },
+	{ secadm_hash_sha256, SHA256_DIGEST_LENGTH, integriforce_sha256_init,
+	    integriforce_sha256_update, integriforce_sha256_final },
+	{ secadm_hash_blake3, SECADM_BLAKE3_DIGEST_LEN, integriforce_blake3_init,
+	    integriforce_blake3_update, integriforce_blake3_final },
+};
+
+static const struct integriforce_digest *
+integriforce_digest(secadm_hash_type_t type)
+{
+	int i;
+
+	for (i = 0; i < nitems(integriforce_digests); i++) {
+		if (integriforce_digests[i].id_type == type)
+			return (&(integriforce_digests[i]));
+	}
+
+	return (NULL);
+}
+
+/*
+ * Files are hashed through a buffer large enough that a big binary
+ * takes a few thousand reads rather than tens of thousands.  Buffers
+ * come from a zone so that back to back checks reuse one from the
+ * per-CPU cache instead of going to the allocator each time.  The
+ * digest context rides along, as BLAKE3's is too big for the stack.
+ */
+#define	INTEGRIFORCE_BUFSIZE	(128 * 1024)
+
+struct integriforce_work {
+	union integriforce_ctx	 iw_ctx;
+	u_char			 iw_buf[INTEGRIFORCE_BUFSIZE];
+};
+
+static uma_zone_t integriforce_buf_zone;
+
+/* Background preverification; see integriforce_preverify(). */
+static struct taskqueue *integriforce_tq;
+static volatile u_int integriforce_stopping;
+
+/*
+ * Results shared between rules.  Jails built on nullfs-mounted base
+ * systems each have their own rule, and their own vnode, for what is one
+ * file underneath.  When an Integriforce rule is added it is tied to a
+ * shared record for the file at the bottom of any nullfs stack and the
+ * digest the rule expects.  Rules agreeing on both get the same record
+ * and with it one stamp: whichever of them hashes the file first answers
+ * for all the others, and checks through any of them wait on the one
+ * hash in flight.
+ *
+ * Records are indexed by file, chained for the rare file that rules
+ * expect different digests of, and live for as long as a rule refers to
+ * them.  The index therefore holds just the files loaded rules name, and
+ * is only touched as rules come and go.
+ *
+ * Writers are counted on the lower vnode, whichever vnode of the stack
+ * they went through, and so are checked against the same counts as a
+ * rule's own stamp.
+ */
+struct integriforce_shared {
+	secadm_key_t			 is_key;	/* the lower file */
+	struct integriforce_shared	*is_next;	/* same file */
+	u_int				 is_refs;
+	secadm_hash_type_t		 is_type;
+	u_char				 is_hash[SECADM_MAX_DIGEST_LEN];
+	struct secadm_verify		 is_verify;
+};
+
+/* Protects the index, the chains and the reference counts. */
+static struct sx integriforce_shared_lock;
+static secadm_table_t integriforce_shared_index;
+static counter_u64_t integriforce_shared_hits;
+
+SYSCTL_COUNTER_U64(_hardening_secadm, OID_AUTO, integriforce_shared_hits,
+    CTLFLAG_RD, &integriforce_shared_hits,
+    "Integriforce checks answered by another rule's result for the file");
+
+void
+integriforce_init(void)
+{
+
+	integriforce_buf_zone = uma_zcreate("secadm hash buffer",
+	    sizeof(struct integriforce_work), NULL, NULL, NULL, NULL,
+	    UMA_ALIGN_CACHE, 0);
+
+	integriforce_tq = taskqueue_create("secadm preverify", M_WAITOK,
+	    taskqueue_thread_enqueue, &integriforce_tq);
+	taskqueue_start_threads(&integriforce_tq, mp_ncpus, PRI_MAX_KERN,
+	    "secadm preverify");
+}
+
+/*
+ * Called before the prison entries go away: preverification jobs hold
+ * references into them.
+ */
+void
+integriforce_uninit(void)
+{
+
+	atomic_store_rel_int(&integriforce_stopping, 1);
+	taskqueue_drain_all(integriforce_tq);
+	taskqueue_free(integriforce_tq);
+
+	uma_zdestroy(integriforce_buf_zone);
+}
+
+void
+integriforce_shared_init(void)
+{
+
+	sx_init(&integriforce_shared_lock, "secadm integriforce shared");
+	secadm_table_init(&integriforce_shared_index);
+	integriforce_shared_hits = counter_u64_alloc(M_WAITOK);
+}
+
+/* Called once every rule is gone. */
+void
+integriforce_shared_uninit(void)
+{
+
+	KASSERT(integriforce_shared_index.st_count == 0,
+	    ("secadm: %zu shared Integriforce records left",
+	    integriforce_shared_index.st_count));
+
+	secadm_table_destroy(&integriforce_shared_index);
+	sx_destroy(&integriforce_shared_lock);
+	counter_u64_free(integriforce_shared_hits);
+}
+
+/*
+ * A verification result stands until the file changes.  A change shows
+ * up in the inode change time, which every write, truncation, rename
+ * and attribute update bumps and which userland cannot set back, and
+ * usually also in the modification time, size and filesystem revision.
+ * Writes through the vnode are caught as they happen by the label's
+ * write count, without waiting on the filesystem to update times.
+ */
+static int
+integriforce_verify_get(struct secadm_verify *sv, struct vattr *vap,
+    u_int writes)
+{
+	u_int seq;
+	int state;
+
+	seq = atomic_load_acq_int(&(sv->sv_seq));
+
+	if (seq & 1)
+		return (SECADM_VERIFY_NONE);
+
+	state = sv->sv_state;
+
+	if (sv->sv_writes != writes ||
+	    sv->sv_filerev != vap->va_filerev ||
+	    sv->sv_size != vap->va_size ||
+	    timespeccmp(&(sv->sv_mtime), &(vap->va_mtime), !=) ||
+	    timespeccmp(&(sv->sv_ctime), &(vap->va_ctime), !=))
+		state = SECADM_VERIFY_NONE;
+
+	atomic_thread_fence_acq();
+
+	if (atomic_load_int(&(sv->sv_seq)) != seq)
+		return (SECADM_VERIFY_NONE);
+
+	return (state);
+}
+
+static void
+integriforce_verify_set(struct secadm_verify *sv, struct vattr *vap,
+    u_int writes, int state)
+{
+	u_int seq;
+
+	seq = atomic_load_int(&(sv->sv_seq));
+
+	if ((seq & 1) || !atomic_cmpset_acq_int(&(sv->sv_seq), seq, seq + 1))
+		return;
+
+	sv->sv_state = state;
+	sv->sv_writes = writes;
+	sv->sv_filerev = vap->va_filerev;
+	sv->sv_size = vap->va_size;
+	sv->sv_mtime = vap->va_mtime;
+	sv->sv_ctime = vap->va_ctime;
+
+	atomic_store_rel_int(&(sv->sv_seq), seq + 2);
+}
+
+/*
+ * The vnode at the bottom of a nullfs stack.  The caller holds vp
+ * locked, which a nullfs vnode shares with the one below, so none of the
+ * stack can be reclaimed under us; one reclaimed before we got the lock
+ * has no mount and is returned as is.
+ */
+struct vnode *
+integriforce_lower_vnode(struct vnode *vp)
+{
+
+	ASSERT_VOP_LOCKED(vp, "integriforce_lower_vnode");
+
+	while (vp->v_mount != NULL &&
+	    strcmp(vp->v_mount->mnt_stat.f_fstypename, "nullfs") == 0)
+		vp = NULLVPTOLOWERVP(vp);
+
+	return (vp);
+}
+
+/*
+ * Tie a rule whose key is filled in to the shared record for its file
+ * and digest, creating the record if this is the first such rule.  fsid
+ * is the file system the file lives on underneath any nullfs mounts.
+ */
+void
+integriforce_share(secadm_rule_t *rule, fsid_t *fsid)
+{
+	struct integriforce_shared *head, *is;
+	secadm_integriforce_data_t *data;
+	secadm_key_t key, *k;
+	uint64_t hash;
+
+	data = rule->sr_integriforce_data;
+
+	memset(&key, 0x00, sizeof(secadm_key_t));
+	key.sk_fsid = *fsid;
+	key.sk_fileid = rule->sr_key.sk_fileid;
+	hash = secadm_hash(&key);
+
+	sx_xlock(&integriforce_shared_lock);
+	head = NULL;
+	if ((k = secadm_table_lookup(&integriforce_shared_index, &key,
+	    hash)) != NULL)
+		head = __containerof(k, struct integriforce_shared, is_key);
+
+	/* Unused digest bytes are zero on both sides. */
+	for (is = head; is != NULL; is = is->is_next) {
+		if (is->is_type == data->si_type &&
+		    !memcmp(is->is_hash, data->si_hash, sizeof(is->is_hash)))
+			break;
+	}
+
+	if (is != NULL) {
+		is->is_refs++;
+	} else {
+		is = malloc(sizeof(struct integriforce_shared), M_SECADM,
+		    M_WAITOK | M_ZERO);
+		is->is_key = key;
+		is->is_refs = 1;
+		is->is_type = data->si_type;
+		memcpy(is->is_hash, data->si_hash, sizeof(is->is_hash));
+
+		if (head != NULL) {
+			is->is_next = head->is_next;
+			head->is_next = is;
 		} else {
-			printf("[SECADM] Error: hash did not match for file"
-			       " (%s). Blocking execution.\n",
-			       rule->sr_integriforce_data->si_path);
-			return (EPERM);
+			secadm_table_insert(&integriforce_shared_index,
+			    &(is->is_key), hash);
 		}
 	}
+	sx_xunlock(&integriforce_shared_lock);
 
-	err = VOP_OPEN(vp, FREAD, ucred, curthread, NULL);
-	if (err) {
-		return (0);
+	*kernel_rule_shared(rule) = is;
+}
+
+void
+integriforce_unshare(secadm_rule_t *rule)
+{
+	struct integriforce_shared *head, *is, **isp;
+	uint64_t hash;
+
+	isp = kernel_rule_shared(rule);
+	if ((is = *isp) == NULL)
+		return;
+
+	*isp = NULL;
+
+	sx_xlock(&integriforce_shared_lock);
+	if (--is->is_refs > 0) {
+		sx_xunlock(&integriforce_shared_lock);
+		return;
 	}
 
-	buf = malloc(8192, M_SECADM, M_NOWAIT);
-	if (buf == NULL) {
-		VOP_CLOSE(vp, FREAD, ucred, curthread);
-		return (0);
+	hash = secadm_hash(&(is->is_key));
+	head = __containerof(secadm_table_lookup(&integriforce_shared_index,
+	    &(is->is_key), hash), struct integriforce_shared, is_key);
+
+	if (head == is) {
+		secadm_table_remove(&integriforce_shared_index, &(is->is_key),
+		    hash);
+		if (is->is_next != NULL)
+			secadm_table_insert(&integriforce_shared_index,
+			    &(is->is_next->is_key), hash);
+	} else {
+		while (head->is_next != is)
+			head = head->is_next;
+		head->is_next = is->is_next;
 	}
+	sx_xunlock(&integriforce_shared_lock);
 
-	switch (rule->sr_integriforce_data->si_type) {
-	case secadm_hash_sha1:
-		hashsz = SHA1_RESULTLEN;
-		SHA1Init(&sha1ctx);
-		break;
-	case secadm_hash_sha256:
-		hashsz = SHA256_DIGEST_LENGTH;
-		SHA256_Init(&sha256ctx);
-		break;
-	default:
-		VOP_CLOSE(vp, FREAD, ucred, curthread);
-		free(buf, M_SECADM);
+	free(is, M_SECADM);
+}
+
+/*
+ * The rule's shared record, provided lvp, the vnode at the bottom of the
+ * file's nullfs stack, is still the file the record was made for.
+ */
+static struct integriforce_shared *
+integriforce_shared_find(secadm_rule_t *rule, struct vattr *vap,
+    struct vnode *lvp)
+{
+	struct integriforce_shared *is;
+
+	if ((is = *kernel_rule_shared(rule)) == NULL)
+		return (NULL);
+
+	if (lvp->v_mount == NULL ||
+	    is->is_key.sk_fileid != vap->va_fileid ||
+	    memcmp(&(is->is_key.sk_fsid), &(lvp->v_mount->mnt_stat.f_fsid),
+	    sizeof(fsid_t)))
+		return (NULL);
+
+	return (is);
+}
+
+static int
+integriforce_mismatch(secadm_rule_t *rule)
+{
+
+	if (rule->sr_integriforce_data->si_mode == 0) {
+		printf("[SECADM] Warning: hash did not match for file"
+		       " (%s)\n", rule->sr_integriforce_data->si_path);
 		return (0);
 	}
 
-	total = vap->va_size;
-	while (total > 0) {
-		amt = MIN(total, 8192);
-		iov.iov_base = buf;
+	printf("[SECADM] Error: hash did not match for file"
+	       " (%s). Blocking execution.\n",
+	       rule->sr_integriforce_data->si_path);
+	return (EPERM);
+}
+
+/*
+ * Hash the file and compare it against the rule.  Returns
+ * SECADM_VERIFY_NONE if the file could not be read.
+ */
+static int
+integriforce_hash(secadm_rule_t *rule, struct vattr *vap, struct vnode *vp,
+    struct ucred *ucred)
+{
+	const struct integriforce_digest *id;
+	struct integriforce_work *w;
+	struct iovec iov;
+	struct uio uio;
+	unsigned char hash[SECADM_MAX_DIGEST_LEN];
+	size_t amt;
+	int err;
+
+	if ((id = integriforce_digest(rule->sr_integriforce_data->si_type)) ==
+	    NULL)
+		return (SECADM_VERIFY_NONE);
+
+	err = VOP_OPEN(vp, FREAD, ucred, curthread, NULL);
+	if (err) {
+		return (SECADM_VERIFY_NONE);
+	}
+
+	w = uma_zalloc(integriforce_buf_zone, M_WAITOK);
+
+	id->id_init(&(w->iw_ctx));
+
+	uio.uio_iov = &iov;
+	uio.uio_iovcnt = 1;
+	uio.uio_offset = 0;
+	uio.uio_segflg = UIO_SYSSPACE;
+	uio.uio_rw = UIO_READ;
+	uio.uio_td = curthread;
+
+	while (uio.uio_offset < vap->va_size) {
+		amt = MIN(vap->va_size - uio.uio_offset, INTEGRIFORCE_BUFSIZE);
+		iov.iov_base = w->iw_buf;
 		iov.iov_len = amt;
-		uio.uio_iov = &iov;
-		uio.uio_iovcnt = 1;
-		uio.uio_offset = vap->va_size - total;
 		uio.uio_resid = amt;
-		uio.uio_segflg = UIO_SYSSPACE;
-		uio.uio_rw = UIO_READ;
-		uio.uio_td = curthread;
-		err = VOP_READ(vp, &uio, 0, ucred);
+
+		/*
+		 * The whole file is read front to back: ask for as much
+		 * read-ahead as the filesystem will do.  uio_offset moves
+		 * on by what was read.
+		 */
+		err = VOP_READ(vp, &uio, IO_SEQMAX << IO_SEQSHIFT, ucred);
 		if (err) {
 			VOP_CLOSE(vp, FREAD, ucred, curthread);
-			free(buf, M_SECADM);
-			return (0);
+			uma_zfree(integriforce_buf_zone, w);
+			return (SECADM_VERIFY_NONE);
 		}
 
-		switch (rule->sr_integriforce_data->si_type) {
-		case secadm_hash_sha1:
-			SHA1Update(&sha1ctx, buf, amt);
+		/*
+		 * The file shrank under us.  Hash what there is and let
+		 * the digest decide.
+		 */
+		if (uio.uio_resid == amt)
 			break;
-		case secadm_hash_sha256:
-			SHA256_Update(&sha256ctx, buf, amt);
-			break;
-		default:
-			break;
-		}
 
-		total -= amt;
+		amt -= uio.uio_resid;
+
+		id->id_update(&(w->iw_ctx), w->iw_buf, amt);
 	}
 
-	free(buf, M_SECADM);
+	id->id_final(&(w->iw_ctx), hash);
+
+	uma_zfree(integriforce_buf_zone, w);
 	VOP_CLOSE(vp, FREAD, ucred, curthread);
 
-	switch (rule->sr_integriforce_data->si_type) {
-	case secadm_hash_sha1:
-		SHA1Final(hash, &sha1ctx);
-		break;
-	case secadm_hash_sha256:
-		SHA256_Final(hash, &sha256ctx);
-		break;
+	if (memcmp(rule->sr_integriforce_data->si_hash, hash, id->id_len))
+		return (SECADM_VERIFY_MISMATCH);
+
+	return (SECADM_VERIFY_OK);
+}
+
+/*
+ * Take the result from the stamp sv or, failing that, hash the file and
+ * stamp it.  Only one thread hashes for a stamp at a time.  Everyone
+ * else checking the file meanwhile sleeps until the result is in and
+ * then takes it from the stamp, so an exec storm on a freshly installed
+ * binary reads it once rather than once per exec.  writes is the write
+ * count of wvp, the vnode whose writers void the stamp.
+ */
+static int
+integriforce_verify_once(struct secadm_verify *sv, struct vnode *wvp,
+    u_int writes, secadm_rule_t *rule, struct vattr *vap, struct vnode *vp,
+    struct ucred *ucred)
+{
+	struct mtx *mtx;
+	u_int wanted;
+	int state;
+
+	mtx = mtx_pool_find(mtxpool_sleep, sv);
+
+	mtx_lock(mtx);
+	while (sv->sv_flags & SECADM_VERIFY_BUSY) {
+		sv->sv_flags |= SECADM_VERIFY_WANTED;
+		msleep(sv, mtx, PVFS, "secadmv", 0);
+	}
+
+	state = SECADM_VERIFY_NONE;
+	if (wvp->v_writecount == 0)
+		state = integriforce_verify_get(sv, vap, writes);
+	if (state == SECADM_VERIFY_NONE)
+		sv->sv_flags |= SECADM_VERIFY_BUSY;
+	mtx_unlock(mtx);
+
+	if (state != SECADM_VERIFY_NONE)
+		return (state);
+
+	state = integriforce_hash(rule, vap, vp, ucred);
+
+	/*
+	 * A file still open for writing, or mapped shared and writable,
+	 * can change under the stamp without the count moving.  Waiters
+	 * then hash it again themselves, one at a time.
+	 */
+	if (state != SECADM_VERIFY_NONE && wvp->v_writecount == 0)
+		integriforce_verify_set(sv, vap, writes, state);
+
+	mtx_lock(mtx);
+	wanted = sv->sv_flags & SECADM_VERIFY_WANTED;
+	sv->sv_flags &= ~(SECADM_VERIFY_BUSY | SECADM_VERIFY_WANTED);
+	mtx_unlock(mtx);
+
+	if (wanted)
+		wakeup(sv);
+
+	return (state);
+}
+
+/*
+ * The rule's own stamp is tried first.  Past that, the file is verified
+ * through the record shared with other rules for it, and the result
+ * copied into the rule's stamp.  The caller holds vp locked.
+ *
+ * Both stamps are checked against the writers of the vnode at the
+ * bottom of vp's nullfs stack.  Only that one sees every writer: a host
+ * process writing to a file a jail runs through nullfs never touches
+ * the jail's vnode.
+ */
+static int
+integriforce_verify(secadm_rule_t *rule, struct vattr *vap, struct vnode *vp,
+    struct ucred *ucred)
+{
+	struct integriforce_shared *is;
+	struct secadm_verify *sv;
+	struct vnode *lvp;
+	u_int writes;
+	int state;
+
+	ASSERT_VOP_LOCKED(vp, "integriforce_verify");
+
+	sv = kernel_rule_verify(rule);
+	lvp = integriforce_lower_vnode(vp);
+
+	/* Before reading, so a write racing the hash voids the result. */
+	writes = secadm_vnode_watch_writes(lvp);
+
+	/* See secadm_vnode_check_mmap() for why writers void the stamp. */
+	state = SECADM_VERIFY_NONE;
+	if (lvp->v_writecount == 0)
+		state = integriforce_verify_get(sv, vap, writes);
+	if (state != SECADM_VERIFY_NONE)
+		return (state);
+
+	if ((is = integriforce_shared_find(rule, vap, lvp)) != NULL) {
+		state = SECADM_VERIFY_NONE;
+		if (lvp->v_writecount == 0)
+			state = integriforce_verify_get(&(is->is_verify), vap,
+			    writes);
+
+		if (state != SECADM_VERIFY_NONE)
+			counter_u64_add(integriforce_shared_hits, 1);
+		else
+			state = integriforce_verify_once(&(is->is_verify), lvp,
+			    writes, rule, vap, vp, ucred);
+
+		if (state != SECADM_VERIFY_NONE && lvp->v_writecount == 0)
+			integriforce_verify_set(sv, vap, writes, state);
+	} else {
+		state = integriforce_verify_once(sv, lvp, writes, rule, vap,
+		    vp, ucred);
+	}
+
+	/* Reported back with the rule only. */
+	atomic_store_int((volatile u_int *)
+	    &(rule->sr_integriforce_data->si_cache), state);
+
+	return (state);
+}
+
+int
+do_integriforce_check(secadm_rule_t *rule, struct vattr *vap,
+    struct vnode *vp, struct ucred *ucred)
+{
+
+	switch (integriforce_verify(rule, vap, vp, ucred)) {
+	case SECADM_VERIFY_MISMATCH:
+		return (integriforce_mismatch(rule));
 	default:
-		break;
+		/* Unreadable files were never blocked. */
+		return (0);
+	}
+}
+
+/*
+ * Preverification hashes the files of a freshly published ruleset in
+ * the background, so the stamps are in place before the first exec of
+ * each instead of that exec waiting on the read.  A job holds a
+ * reference on each active Integriforce rule and runs as up to one task
+ * per CPU, each pulling the next rule off the shared array until it is
+ * exhausted.  Publishing another ruleset, flushing the rules or
+ * switching preverification off replaces the prison's current job and
+ * the old one winds down after the file it is on.
+ *
+ * Progress is counted in the job itself, so a worker of a superseded job
+ * finishing its file cannot show up in the new job's status.  The prison
+ * entry holds a reference on its current job and the workers share
+ * another; the rules are let go as soon as the workers are done.
+ *
+ * Each task hashes one file at a time on purpose, rather than feeding
+ * several through a multi-buffer SIMD hash.  A file's stamp is held
+ * busy while it is hashed and an exec of that file sleeps on it, so
+ * hashing files in lockstep would make that exec wait for the largest
+ * file in the batch.  Throughput already scales with the CPU count.
+ */
+struct integriforce_preverify {
+	secadm_prison_entry_t	 *pv_entry;
+	u_int			  pv_refs;
+	secadm_rule_t		**pv_rules;
+	u_int			  pv_nrules;
+	volatile u_int		  pv_next;
+	volatile u_int		  pv_workers;
+	secadm_preverify_status_t pv_status;
+	struct task		  pv_tasks[];
+};
+
+static int
+integriforce_preverify_current(struct integriforce_preverify *pv)
+{
+
+	return (atomic_load_acq_int(&integriforce_stopping) == 0 &&
+	    (struct integriforce_preverify *)atomic_load_acq_ptr(
+	    (volatile uintptr_t *)&(pv->pv_entry->sp_preverify)) == pv);
+}
+
+static void
+integriforce_preverify_release(struct integriforce_preverify *pv)
+{
+
+	if (refcount_release(&(pv->pv_refs))) {
+		free(pv, M_SECADM);
+	}
+}
+
+/*
+ * Rule paths are as seen from the prison that loaded them, so the file
+ * is found by its identity rather than by path.
+ */
+static int
+integriforce_preverify_rule(secadm_rule_t *rule, struct ucred *ucred)
+{
+	struct mount *mp;
+	struct vattr vap;
+	struct vnode *vp;
+	int state;
+
+	if ((mp = vfs_busyfs(&(rule->sr_key.sk_fsid))) == NULL) {
+		return (SECADM_VERIFY_NONE);
 	}
 
-	if (memcmp(rule->sr_integriforce_data->si_hash, hash, hashsz)) {
-		switch (rule->sr_integriforce_data->si_mode) {
-		case 0:
-			printf("[SECADM] Warning: hash did not match for file"
-			       " (%s)\n",
-			       rule->sr_integriforce_data->si_path);
-			err = 0;
+	if (VFS_VGET(mp, rule->sr_key.sk_fileid, LK_SHARED, &vp)) {
+		vfs_unbusy(mp);
+		return (SECADM_VERIFY_NONE);
+	}
+
+	vfs_unbusy(mp);
+
+	state = SECADM_VERIFY_NONE;
+
+	if (vp->v_type == VREG && VOP_GETATTR(vp, &vap, ucred) == 0 &&
+	    vap.va_fileid == rule->sr_key.sk_fileid) {
+		state = integriforce_verify(rule, &vap, vp, ucred);
+	}
+
+	vput(vp);
+
+	return (state);
+}
+
+static void
+integriforce_preverify_task(void *arg, int pending)
+{
+	struct integriforce_preverify *pv;
+	secadm_preverify_status_t *ps;
+	secadm_rule_t *rule;
+	u_int i;
+	int state;
+
+	pv = arg;
+	ps = &(pv->pv_status);
+
+	while (integriforce_preverify_current(pv) &&
+	    (i = atomic_fetchadd_int(&(pv->pv_next), 1)) < pv->pv_nrules) {
+		rule = pv->pv_rules[i];
+		state = integriforce_preverify_rule(rule, curthread->td_ucred);
+
+		if (!integriforce_preverify_current(pv))
+			break;
+
+		switch (state) {
+		case SECADM_VERIFY_OK:
+			atomic_add_int(&(ps->ps_verified), 1);
+			break;
+		case SECADM_VERIFY_MISMATCH:
+			printf("[SECADM] Preverify: hash did not match for"
+			    " file (%s)\n", rule->sr_integriforce_data->si_path);
+			atomic_add_int(&(ps->ps_mismatched), 1);
 			break;
 		default:
-			printf("[SECADM] Error: hash did not match for file"
-			       " (%s). Blocking execution.\n",
-			       rule->sr_integriforce_data->si_path);
-			err = EPERM;
+			atomic_add_int(&(ps->ps_unreadable), 1);
 			break;
 		}
 
-		rule->sr_integriforce_data->si_cache = 2;
-	} else {
-		rule->sr_integriforce_data->si_cache = 1;
+		atomic_add_rel_int(&(ps->ps_done), 1);
 	}
 
-	return (err);
+	if (atomic_fetchadd_int(&(pv->pv_workers), -1) == 1) {
+		for (i = 0; i < pv->pv_nrules; i++)
+			kernel_rule_release(pv->pv_rules[i]);
+
+		free(pv->pv_rules, M_SECADM);
+		integriforce_preverify_release(pv);
+	}
+}
+
+/*
+ * Start preverifying the prison's published ruleset, superseding any job
+ * still running for it, or just stop that job if preverification is
+ * off.  The caller holds the prison entry locked exclusive.
+ */
+void
+integriforce_preverify(secadm_prison_entry_t *entry)
+{
+	struct integriforce_preverify *old, *pv;
+	secadm_ruleset_t *rs;
+	secadm_rule_t *r;
+	u_int i, n, nworkers;
+	size_t j;
+
+	if ((old = entry->sp_preverify) != NULL) {
+		atomic_store_rel_ptr(
+		    (volatile uintptr_t *)&(entry->sp_preverify), (uintptr_t)NULL);
+		integriforce_preverify_release(old);
+	}
+
+	rs = entry->sp_ruleset;
+	n = 0;
+
+	if (entry->sp_integriforce_flags & SECADM_INTEGRIFORCE_FLAGS_PREVERIFY) {
+		for (j = 0; j < rs->ss_num_rules; j++) {
+			r = rs->ss_rules[j];
+			if (r->sr_type == secadm_integriforce_rule &&
+			    SECADM_RULE_ACTIVE(r))
+				n++;
+		}
+	}
+
+	if (n == 0)
+		return;
+
+	nworkers = MIN(n, (u_int)mp_ncpus);
+
+	pv = malloc(sizeof(struct integriforce_preverify) +
+	    nworkers * sizeof(struct task), M_SECADM, M_WAITOK | M_ZERO);
+	pv->pv_entry = entry;
+	refcount_init(&(pv->pv_refs), 2);
+	pv->pv_rules = mallocarray(n, sizeof(secadm_rule_t *), M_SECADM,
+	    M_WAITOK);
+	pv->pv_workers = nworkers;
+	pv->pv_status.ps_total = n;
+
+	for (j = 0; j < rs->ss_num_rules; j++) {
+		r = rs->ss_rules[j];
+		if (r->sr_type == secadm_integriforce_rule &&
+		    SECADM_RULE_ACTIVE(r)) {
+			kernel_rule_acquire(r);
+			pv->pv_rules[pv->pv_nrules++] = r;
+		}
+	}
+
+	atomic_store_rel_ptr((volatile uintptr_t *)&(entry->sp_preverify),
+	    (uintptr_t)pv);
+
+	for (i = 0; i < nworkers; i++) {
+		TASK_INIT(&(pv->pv_tasks[i]), 0, integriforce_preverify_task,
+		    pv);
+		taskqueue_enqueue(integriforce_tq, &(pv->pv_tasks[i]));
+	}
+}
+
+/*
+ * The progress of the prison's current job, all zero if there is none.
+ * The caller holds the prison entry locked, which keeps the job around.
+ */
+void
+integriforce_preverify_status(secadm_prison_entry_t *entry,
+    secadm_preverify_status_t *status)
+{
+	struct integriforce_preverify *pv;
+
+	memset(status, 0x00, sizeof(secadm_preverify_status_t));
+
+	if ((pv = entry->sp_preverify) == NULL)
+		return;
+
+	/* Updated by the workers without the lock. */
+	status->ps_total = pv->pv_status.ps_total;
+	status->ps_done = atomic_load_acq_int(&(pv->pv_status.ps_done));
+	status->ps_verified = atomic_load_int(&(pv->pv_status.ps_verified));
+	status->ps_mismatched =
+	    atomic_load_int(&(pv->pv_status.ps_mismatched));
+	status->ps_unreadable =
+	    atomic_load_int(&(pv->pv_status.ps_unreadable));
 }
 
 static int
@@ -204,9 +936,11 @@ sysctl_integriforce_so(SYSCTL_HANDLER_ARGS)
 {
 	integriforce_so_check_t *integriforce_so;
 	secadm_prison_entry_t *entry;
-	secadm_rule_t r, *rule;
+	struct epoch_tracker et;
+	secadm_rule_t *rule;
 	struct nameidata nd;
 	struct vattr vap;
+	secadm_file_t *f;
 	secadm_key_t key;
 	int err;
 
@@ -238,41 +972,53 @@ sysctl_integriforce_so(SYSCTL_HANDLER_ARGS)
 		return (err);
 	}
 
+	/*
+	 * Hashing reads the file, and finding the record shared with other
+	 * rules for it walks its nullfs stack: the vnode stays locked until
+	 * the check is done.
+	 */
 	err = VOP_GETATTR(nd.ni_vp, &vap, req->td->td_ucred);
-	if (err) {
-		free(integriforce_so, M_SECADM);
-		NDFREE(&nd, 0);
-		return (err);
+	if (err == 0) {
+		memset(&key, 0x00, sizeof(secadm_key_t));
+		key.sk_fsid = nd.ni_vp->v_mount->mnt_stat.f_fsid;
+		key.sk_fileid = vap.va_fileid;
+
+		entry = lookup_prison_list_entry(
+		    req->td->td_ucred->cr_prison->pr_id);
+
+		SECADM_EPOCH_ENTER(et);
+		rule = NULL;
+		if (entry != NULL &&
+		    (f = kernel_lookup_file(SECADM_RULESET(entry), &key)) !=
+		    NULL) {
+			rule = f->sfi_integriforce;
+		}
+
+		if (rule) {
+			kernel_rule_acquire(rule);
+		}
+		SECADM_EPOCH_EXIT(et);
+
+		if (rule) {
+			integriforce_so->isc_result =
+			    do_integriforce_check(rule, &vap, nd.ni_vp,
+			    req->td->td_ucred);
+			kernel_rule_release(rule);
+		}
 	}
 
-	
 #if __FreeBSD_version >= 1300074
 	VOP_UNLOCK(nd.ni_vp);
 #else
 	VOP_UNLOCK(nd.ni_vp, 0);
 #endif
 
-	key.sk_jid = req->td->td_ucred->cr_prison->pr_id;
-	key.sk_type = secadm_integriforce_rule;
-	key.sk_fileid = vap.va_fileid;
-	strncpy(key.sk_mntonname,
-	    nd.ni_vp->v_mount->mnt_stat.f_mntonname, MNAMELEN);
-	r.sr_key = fnv_32_buf(&key, sizeof(secadm_key_t), FNV1_32_INIT);
-
-	entry = get_prison_list_entry(
-	    req->td->td_ucred->cr_prison->pr_id);
-
-	PE_RLOCK(entry);
-	rule = RB_FIND(secadm_rules_tree, &(entry->sp_rules), &r);
-
-	if (rule) {
-		integriforce_so->isc_result =
-		    do_integriforce_check(rule, &vap, nd.ni_vp,
-		    req->td->td_ucred);
+	if (err) {
+		free(integriforce_so, M_SECADM);
+		NDFREE(&nd, 0);
+		return (err);
 	}
 
-	PE_RUNLOCK(entry);
-
 	SYSCTL_OUT(req, integriforce_so, sizeof(integriforce_so_check_t));
 	free(integriforce_so, M_SECADM);
 
@@ -27,6 +27,8 @@
 
 #include <sys/param.h>
 
+#include <sys/bitstring.h>
+#include <sys/epoch.h>
 #include <sys/fcntl.h>
 #include <sys/imgact.h>
 #include <sys/jail.h>
@@ -35,69 +37,139 @@
 #include <sys/module.h>
 #include <sys/mount.h>
 #include <sys/namei.h>
+#include <sys/pax.h>
 #include <sys/proc.h>
+#include <sys/refcount.h>
+#include <sys/sbuf.h>
+#include <sys/sysctl.h>
 #include <sys/systm.h>
 #include <sys/sx.h>
-#include <sys/tree.h>
 #include <sys/ucred.h>
 #include <sys/vnode.h>
 
+#include <crypto/siphash/siphash.h>
+#include <vm/uma.h>
+
 #include "secadm.h"
 
 FEATURE(secadm, "HardenedBSD Security Administration (secadm)");
 
 MALLOC_DEFINE(M_SECADM, "secadm", "HardenedBSD SECADM data");
-RB_GENERATE(secadm_rules_tree, secadm_rule, sr_tree, secadm_rule_cmp);
 
-secadm_prisons_t secadm_prison_list;
+epoch_t secadm_epoch;
 
-int
-secadm_rule_cmp(secadm_rule_t *a, secadm_rule_t *b)
+/* Source of ruleset generations; never reused, never zero. */
+static uint64_t secadm_generation;
+
+static secadm_ruleset_t *kernel_build_ruleset(secadm_prison_entry_t *);
+static void kernel_bump_generation(secadm_prison_entry_t *);
+
+/*
+ * Rule keys are hashed with SipHash under a secret picked at load time,
+ * so a local user cannot craft files whose keys pile up in one chain.
+ */
+static uint8_t secadm_hash_secret[SIPHASH_KEY_LENGTH];
+
+void
+secadm_hash_init(void)
 {
-	if (a->sr_key < b->sr_key)
-		return (-1);
 
-	if (a->sr_key > b->sr_key)
-		return (1);
+	arc4random_buf(secadm_hash_secret, sizeof(secadm_hash_secret));
+}
 
-	return (0);
+uint64_t
+secadm_hash(secadm_key_t *key)
+{
+	SIPHASH_CTX ctx;
+
+	return (SipHash24(&ctx, secadm_hash_secret, key,
+	    sizeof(secadm_key_t)));
 }
 
-secadm_prison_entry_t *
-get_prison_list_entry(int jid)
+/* Initial size of a prison's rule ID table. */
+#define	SECADM_MIN_IDS		64
+
+static secadm_prison_entry_t *
+find_prison_entry(int jid)
 {
 	secadm_prison_entry_t *entry;
 
-	PL_RLOCK();
-	SLIST_FOREACH(entry, &(secadm_prisons_list.sp_prison), sp_entries) {
+	entry = (secadm_prison_entry_t *)atomic_load_acq_ptr(
+	    (volatile uintptr_t *)&(secadm_prisons_list.sp_buckets[
+	    SECADM_PRISON_BUCKET(jid)]));
+
+	for (; entry != NULL; entry = entry->sp_next) {
 		if (entry->sp_id == jid) {
-			PL_RUNLOCK();
 			return (entry);
 		}
 	}
-	PL_RUNLOCK();
 
-	entry = malloc(sizeof(secadm_prison_entry_t),
+	return (NULL);
+}
+
+/*
+ * Lookup for the hooks.  Never allocates: a prison that has no entry
+ * yet has never had rules or TPE configured, and NULL says so.
+ */
+secadm_prison_entry_t *
+lookup_prison_list_entry(int jid)
+{
+
+	return (find_prison_entry(jid));
+}
+
+secadm_prison_entry_t *
+get_prison_list_entry(int jid)
+{
+	secadm_prison_entry_t *entry, *new;
+	u_int bucket;
+
+	if ((entry = find_prison_entry(jid)) != NULL) {
+		return (entry);
+	}
+
+	new = malloc(sizeof(secadm_prison_entry_t),
 	    M_SECADM, M_WAITOK | M_ZERO);
 
-	PE_INIT(entry);
-	PE_WLOCK(entry);
-	entry->sp_id = jid;
-	RB_INIT(&(entry->sp_rules));
-	RB_INIT(&(entry->sp_staging));
-	PE_WUNLOCK(entry);
+	PE_INIT(new);
+	new->sp_id = jid;
+	new->sp_ruleset = kernel_build_ruleset(new);
+	kernel_bump_generation(new);
+	kernel_update_features(new);
+	TAILQ_INIT(&(new->sp_staging));
+	secadm_table_init(&(new->sp_staging_index));
 
+	bucket = SECADM_PRISON_BUCKET(jid);
+
+	/* Someone may have beaten us to it while we were allocating. */
 	PL_WLOCK();
-	SLIST_INSERT_HEAD(&(secadm_prisons_list.sp_prison),
-	    entry, sp_entries);
+	if ((entry = find_prison_entry(jid)) == NULL) {
+		new->sp_next = secadm_prisons_list.sp_buckets[bucket];
+		atomic_store_rel_ptr(
+		    (volatile uintptr_t *)&(secadm_prisons_list.sp_buckets[bucket]),
+		    (uintptr_t)new);
+		entry = new;
+		new = NULL;
+	}
 	PL_WUNLOCK();
 
+	if (new != NULL) {
+		kernel_free_ruleset(new->sp_ruleset);
+		PE_DESTROY(new);
+		free(new, M_SECADM);
+	}
+
 	return (entry);
 }
 
+/*
+ * Look up path and return the fsid of its file system and its
+ * attributes.  If lowerfsid is not NULL, it is set to the fsid the file
+ * has underneath any nullfs mounts.
+ */
 int
-get_mntonname_vattr(struct thread *td, u_char *path, char *mntonname,
-    struct vattr *vap)
+get_fsid_vattr(struct thread *td, u_char *path, fsid_t *fsid,
+    fsid_t *lowerfsid, struct vattr *vap)
 {
 	struct nameidata nd;
 	int error = 1;
@@ -114,8 +186,12 @@ get_mntonname_vattr(struct thread *td, u_char *path, char *mntonname,
 		return (error);
 	}
 
-	strlcpy(mntonname,
-	    nd.ni_vp->v_mount->mnt_stat.f_mntonname, MNAMELEN);
+	*fsid = nd.ni_vp->v_mount->mnt_stat.f_fsid;
+
+	if (lowerfsid != NULL) {
+		*lowerfsid = integriforce_lower_vnode(
+		    nd.ni_vp)->v_mount->mnt_stat.f_fsid;
+	}
 
 	error = VOP_GETATTR(nd.ni_vp, vap, td->td_ucred);
 
@@ -125,95 +201,523 @@ get_mntonname_vattr(struct thread *td, u_char *path, char *mntonname,
 	return (error);
 }
 
+/*
+ * Each rule is a single record: the rule, its type data and, for
+ * Integriforce, the digest.  Records come from a zone per rule type, so
+ * loading or flushing a large ruleset is served from UMA's per-CPU
+ * caches, and a lookup that matches a rule finds the data it needs on
+ * the next cache lines.  The path is interned separately.  Integriforce
+ * records also carry the rule's verification stamp, which is kernel
+ * state and so stays out of the rule handed to and from userland, as
+ * does the shared record it is tied to.
+ */
+struct secadm_pax_record {
+	secadm_rule_t			 spr_rule;
+	secadm_pax_data_t		 spr_data;
+};
+
+struct secadm_integriforce_record {
+	secadm_rule_t			 sir_rule;
+	secadm_integriforce_data_t	 sir_data;
+	u_char				 sir_hash[SECADM_MAX_DIGEST_LEN];
+	struct secadm_verify		 sir_verify;
+	struct integriforce_shared	*sir_shared;
+};
+
+static struct secadm_rule_zone {
+	const char		*srz_name;
+	secadm_rule_type_t	 srz_type;
+	size_t			 srz_size;
+	uma_zone_t		 srz_zone;
+} secadm_rule_zones[] = {
+	{ "secadm pax",		secadm_pax_rule,
+	    sizeof(struct secadm_pax_record) },
+	{ "secadm integriforce", secadm_integriforce_rule,
+	    sizeof(struct secadm_integriforce_record) },
+};
+
+static int sysctl_secadm_zones(SYSCTL_HANDLER_ARGS);
+
+SYSCTL_DECL(_hardening_secadm);
+
+SYSCTL_PROC(_hardening_secadm, OID_AUTO, zones,
+    CTLTYPE_STRING | CTLFLAG_RD | CTLFLAG_MPSAFE, NULL, 0,
+    sysctl_secadm_zones, "A", "Rule records allocated per zone");
+
+void
+secadm_rule_zones_init(void)
+{
+	struct secadm_rule_zone *z;
+	int i;
+
+	for (i = 0; i < nitems(secadm_rule_zones); i++) {
+		z = &(secadm_rule_zones[i]);
+		z->srz_zone = uma_zcreate(z->srz_name, z->srz_size,
+		    NULL, NULL, NULL, NULL, UMA_ALIGN_CACHE, 0);
+	}
+}
+
+void
+secadm_rule_zones_uninit(void)
+{
+	int i;
+
+	for (i = 0; i < nitems(secadm_rule_zones); i++) {
+		uma_zdestroy(secadm_rule_zones[i].srz_zone);
+	}
+}
+
+static struct secadm_rule_zone *
+kernel_rule_zone(secadm_rule_type_t type)
+{
+	int i;
+
+	for (i = 0; i < nitems(secadm_rule_zones); i++) {
+		if (secadm_rule_zones[i].srz_type == type) {
+			return (&(secadm_rule_zones[i]));
+		}
+	}
+
+	return (NULL);
+}
+
+/*
+ * Allocate a zeroed rule of the given type with its data pointer, and
+ * for Integriforce its digest pointer, set up to point into the record.
+ * Returns NULL for a type that has no record.
+ */
+secadm_rule_t *
+kernel_alloc_rule(secadm_rule_type_t type)
+{
+	struct secadm_integriforce_record *ir;
+	struct secadm_pax_record *pr;
+	struct secadm_rule_zone *z;
+
+	if ((z = kernel_rule_zone(type)) == NULL) {
+		return (NULL);
+	}
+
+	switch (type) {
+	case secadm_integriforce_rule:
+		ir = uma_zalloc(z->srz_zone, M_WAITOK | M_ZERO);
+		ir->sir_rule.sr_type = type;
+		ir->sir_rule.sr_integriforce_data = &(ir->sir_data);
+		ir->sir_data.si_hash = ir->sir_hash;
+
+		return (&(ir->sir_rule));
+
+	case secadm_pax_rule:
+		pr = uma_zalloc(z->srz_zone, M_WAITOK | M_ZERO);
+		pr->spr_rule.sr_type = type;
+		pr->spr_rule.sr_pax_data = &(pr->spr_data);
+
+		return (&(pr->spr_rule));
+
+	default:
+		return (NULL);
+	}
+}
+
 void
 kernel_free_rule(secadm_rule_t *rule)
 {
+	struct secadm_rule_zone *z;
+
 	if (rule == NULL)
 		return;
 
-	switch (rule->sr_type) {
-	case secadm_integriforce_rule:
-		if (rule->sr_integriforce_data == NULL) {
-			break;
-		}
+	if (rule->sr_type == secadm_integriforce_rule) {
+		integriforce_unshare(rule);
+		secadm_intern_release(rule->sr_integriforce_data->si_path);
+	} else {
+		secadm_intern_release(rule->sr_pax_data->sp_path);
+	}
+
+	z = kernel_rule_zone(rule->sr_type);
+	KASSERT(z != NULL, ("secadm: rule %p has no zone", rule));
 
-		if (rule->sr_integriforce_data->si_path) {
-			free(rule->sr_integriforce_data->si_path, M_SECADM);
+	uma_zfree(z->srz_zone, rule);
+}
+
+struct secadm_verify *
+kernel_rule_verify(secadm_rule_t *rule)
+{
+
+	KASSERT(rule->sr_type == secadm_integriforce_rule,
+	    ("secadm: rule %p is not an Integriforce rule", rule));
+
+	return (&(__containerof(rule, struct secadm_integriforce_record,
+	    sir_rule)->sir_verify));
+}
+
+struct integriforce_shared **
+kernel_rule_shared(secadm_rule_t *rule)
+{
+
+	KASSERT(rule->sr_type == secadm_integriforce_rule,
+	    ("secadm: rule %p is not an Integriforce rule", rule));
+
+	return (&(__containerof(rule, struct secadm_integriforce_record,
+	    sir_rule)->sir_shared));
+}
+
+static int
+sysctl_secadm_zones(SYSCTL_HANDLER_ARGS)
+{
+	struct secadm_rule_zone *z;
+	struct sbuf sb;
+	int err, i;
+
+	sbuf_new_for_sysctl(&sb, NULL, 256, req);
+
+	for (i = 0; i < nitems(secadm_rule_zones); i++) {
+		z = &(secadm_rule_zones[i]);
+
+		sbuf_printf(&sb, "\n%-26s %6zu %8d", z->srz_name,
+		    z->srz_size, uma_zone_get_cur(z->srz_zone));
+	}
+
+	err = sbuf_finish(&sb);
+	sbuf_delete(&sb);
+
+	return (err);
+}
+
+/*
+ * Live rules are indexed by ID in a dense array.  Freed IDs are handed
+ * out again lowest first, so the array stays as small as the largest
+ * ruleset the prison has held and get, enable, disable and delete are
+ * a single array access.  The caller holds the prison entry locked
+ * exclusive.
+ */
+static void
+kernel_alloc_rule_id(secadm_prison_entry_t *entry, secadm_rule_t *rule)
+{
+	secadm_rule_t **ids;
+	bitstr_t *idmap;
+	int id, size;
+
+	bit_ffc(entry->sp_idmap, entry->sp_ids_size, &id);
+
+	if (id == -1) {
+		id = entry->sp_ids_size;
+		size = MAX(id * 2, SECADM_MIN_IDS);
+
+		ids = mallocarray(size, sizeof(secadm_rule_t *),
+		    M_SECADM, M_WAITOK | M_ZERO);
+		idmap = bit_alloc(size, M_SECADM, M_WAITOK);
+
+		if (entry->sp_ids_size) {
+			memcpy(ids, entry->sp_ids,
+			    entry->sp_ids_size * sizeof(secadm_rule_t *));
+			memcpy(idmap, entry->sp_idmap,
+			    bitstr_size(entry->sp_ids_size));
+
+			free(entry->sp_ids, M_SECADM);
+			free(entry->sp_idmap, M_SECADM);
 		}
 
-		if (rule->sr_integriforce_data->si_hash) {
-			free(rule->sr_integriforce_data->si_hash, M_SECADM);
+		entry->sp_ids = ids;
+		entry->sp_idmap = idmap;
+		entry->sp_ids_size = size;
+	}
+
+	bit_set(entry->sp_idmap, id);
+	entry->sp_ids[id] = rule;
+	rule->sr_id = id;
+}
+
+static void
+kernel_insert_rule(secadm_prison_entry_t *entry, secadm_rule_t *rule)
+{
+
+	/* The ID table takes over the caller's reference. */
+	kernel_alloc_rule_id(entry, rule);
+}
+
+static void
+kernel_remove_rule(secadm_prison_entry_t *entry, secadm_rule_t *rule)
+{
+
+	bit_clear(entry->sp_idmap, rule->sr_id);
+	entry->sp_ids[rule->sr_id] = NULL;
+	kernel_rule_release(rule);
+}
+
+static void
+kernel_drop_rules(secadm_prison_entry_t *entry)
+{
+	int id;
+
+	for (id = 0; id < entry->sp_ids_size; id++) {
+		if (entry->sp_ids[id] != NULL) {
+			kernel_rule_release(entry->sp_ids[id]);
 		}
+	}
 
-		free(rule->sr_integriforce_data, M_SECADM);
-		break;
+	if (entry->sp_ids_size) {
+		free(entry->sp_ids, M_SECADM);
+		free(entry->sp_idmap, M_SECADM);
+	}
 
-	case secadm_pax_rule:
-		if (rule->sr_pax_data == NULL) {
-			break;
+	entry->sp_ids = NULL;
+	entry->sp_idmap = NULL;
+	entry->sp_ids_size = 0;
+}
+
+/*
+ * A rule is referenced by every ruleset it is published in and by the
+ * ID table.  Hooks that need it past their epoch section, such as to
+ * hash the file, take a reference of their own while still inside it,
+ * so a flush never frees a rule someone is verifying.
+ */
+void
+kernel_rule_acquire(secadm_rule_t *rule)
+{
+
+	KASSERT(rule->sr_refs > 0, ("secadm: acquiring freed rule %p", rule));
+	refcount_acquire(&(rule->sr_refs));
+}
+
+void
+kernel_rule_release(secadm_rule_t *rule)
+{
+
+	if (refcount_release(&(rule->sr_refs))) {
+		kernel_free_rule(rule);
+	}
+}
+
+/*
+ * Build a ruleset from the live rules, merging the rules for each file
+ * into one per-file record.  The caller holds the prison entry locked
+ * exclusive.
+ */
+static secadm_ruleset_t *
+kernel_build_ruleset(secadm_prison_entry_t *entry)
+{
+	secadm_key_t key, *k;
+	secadm_ruleset_t *rs;
+	secadm_file_t *f;
+	secadm_rule_t *r;
+	uint64_t hash;
+	int count, id;
+
+	rs = malloc(sizeof(secadm_ruleset_t), M_SECADM, M_WAITOK | M_ZERO);
+	secadm_table_init(&(rs->ss_table));
+
+	if (entry->sp_ids_size == 0) {
+		return (rs);
+	}
+
+	bit_count(entry->sp_idmap, 0, entry->sp_ids_size, &count);
+
+	if (count == 0) {
+		return (rs);
+	}
+
+	/* The table points into ss_files, so it is never resized. */
+	rs->ss_rules = mallocarray(count, sizeof(secadm_rule_t *),
+	    M_SECADM, M_WAITOK);
+	rs->ss_files = mallocarray(count, sizeof(secadm_file_t),
+	    M_SECADM, M_WAITOK | M_ZERO);
+	secadm_table_reserve(&(rs->ss_table), count);
+
+	for (id = 0; id < entry->sp_ids_size; id++) {
+		if ((r = entry->sp_ids[id]) == NULL) {
+			continue;
 		}
 
-		if (rule->sr_pax_data->sp_path) {
-			free(rule->sr_pax_data->sp_path, M_SECADM);
+		kernel_rule_acquire(r);
+		rs->ss_rules[rs->ss_num_rules++] = r;
+
+		key = r->sr_key;
+		key.sk_type = 0;
+		hash = secadm_hash(&key);
+
+		if ((k = secadm_table_lookup(&(rs->ss_table), &key,
+		    hash)) != NULL) {
+			f = __containerof(k, secadm_file_t, sfi_key);
+		} else {
+			f = &(rs->ss_files[rs->ss_num_files++]);
+			f->sfi_key = key;
+			secadm_table_insert(&(rs->ss_table), &(f->sfi_key), hash);
 		}
 
-		free(rule->sr_pax_data, M_SECADM);
-		break;
+		switch (r->sr_type) {
+		case secadm_integriforce_rule:
+			f->sfi_integriforce = r;
+			rs->ss_num_integriforce_rules++;
+			break;
 
-	case secadm_extended_rule:
-		if (rule->sr_extended_data == NULL) {
+		case secadm_pax_rule:
+			f->sfi_pax = r;
+			rs->ss_num_pax_rules++;
 			break;
-		}
 
-		if (rule->sr_extended_data->sm_object.mo_path) {
-			free(rule->sr_extended_data->sm_object.mo_path,
-			    M_SECADM);
+		case secadm_extended_rule:
+			rs->ss_num_extended_rules++;
+			break;
 		}
+	}
+
+	secadm_filter_build(&(rs->ss_filter), rs->ss_files, rs->ss_num_files);
 
-		free(rule->sr_extended_data, M_SECADM);
+	return (rs);
+}
+
+void
+kernel_free_ruleset(secadm_ruleset_t *rs)
+{
+	size_t i;
+
+	for (i = 0; i < rs->ss_num_rules; i++) {
+		kernel_rule_release(rs->ss_rules[i]);
+	}
+
+	if (rs->ss_rules != NULL) {
+		free(rs->ss_rules, M_SECADM);
+		free(rs->ss_files, M_SECADM);
 	}
 
-	free(rule, M_SECADM);
+	secadm_filter_destroy(&(rs->ss_filter));
+	secadm_table_destroy(&(rs->ss_table));
+	free(rs, M_SECADM);
+}
+
+/*
+ * Find the record for the file named by key's fsid and fileid.  Called
+ * within the epoch section rs was read in, or with the prison entry
+ * locked.
+ */
+secadm_file_t *
+kernel_lookup_file(secadm_ruleset_t *rs, secadm_key_t *key)
+{
+	secadm_key_t file, *k;
+
+	memset(&file, 0x00, sizeof(secadm_key_t));
+	file.sk_fsid = key->sk_fsid;
+	file.sk_fileid = key->sk_fileid;
+
+	if ((k = secadm_table_lookup(&(rs->ss_table), &file,
+	    secadm_hash(&file))) == NULL) {
+		return (NULL);
+	}
+
+	return (__containerof(k, secadm_file_t, sfi_key));
+}
+
+/*
+ * Lookups cached on vnode labels are tagged with the generation they
+ * were made under.  Giving the prison a new one, unique across all
+ * prisons, invalidates every such entry at once.
+ */
+static void
+kernel_bump_generation(secadm_prison_entry_t *entry)
+{
+
+	atomic_store_rel_64(&(entry->sp_gen),
+	    atomic_fetchadd_64(&secadm_generation, 1) + 1);
+}
+
+/*
+ * Replace the published ruleset with one built from the live rules, and
+ * restart preverification on it.  Hooks still looking at the old
+ * ruleset are waited out before it is freed; rules they took a
+ * reference on outlive it.  The caller holds the prison entry locked
+ * exclusive.
+ */
+static void
+kernel_publish_ruleset(secadm_prison_entry_t *entry)
+{
+	secadm_ruleset_t *old;
+
+	old = entry->sp_ruleset;
+
+	atomic_store_rel_ptr((volatile uintptr_t *)&(entry->sp_ruleset),
+	    (uintptr_t)kernel_build_ruleset(entry));
+	kernel_bump_generation(entry);
+	kernel_update_features(entry);
+	integriforce_preverify(entry);
+
+	epoch_wait_preempt(secadm_epoch);
+	kernel_free_ruleset(old);
+}
+
+/*
+ * Recompute the prison's feature word from its published ruleset and
+ * TPE and Integriforce settings, and pick the exec handler to match.
+ * The caller holds the prison entry locked exclusive.
+ */
+void
+kernel_update_features(secadm_prison_entry_t *entry)
+{
+	u_int features;
+
+	features = 0;
+
+	if (entry->sp_ruleset->ss_num_integriforce_rules) {
+		features |= SECADM_FEATURE_INTEGRIFORCE;
+	}
+
+	if (entry->sp_ruleset->ss_num_pax_rules) {
+		features |= SECADM_FEATURE_PAX;
+	}
+
+	if (entry->sp_tpe_flags & SECADM_TPE_ENABLED) {
+		features |= SECADM_FEATURE_TPE;
+	}
+
+	if ((features & SECADM_FEATURE_INTEGRIFORCE) &&
+	    (entry->sp_integriforce_flags &
+	    SECADM_INTEGRIFORCE_FLAGS_WHITELIST)) {
+		features |= SECADM_FEATURE_WHITELIST;
+	}
+
+	atomic_store_rel_int(&(entry->sp_features), features);
+	atomic_store_rel_ptr((volatile uintptr_t *)&(entry->sp_exec),
+	    (uintptr_t)secadm_vnode_exec_handler(features));
+}
+
+/*
+ * Drop every live rule of a prison and publish the empty ruleset.  The
+ * caller holds the prison entry locked exclusive.
+ */
+void
+kernel_flush_rules(secadm_prison_entry_t *entry)
+{
+
+	kernel_drop_rules(entry);
+	kernel_publish_ruleset(entry);
 }
 
 void
 kernel_flush_ruleset(int jid)
 {
 	secadm_prison_entry_t *entry;
-	secadm_rule_t *r, *next;
 
 	entry = get_prison_list_entry(jid);
 
 	PE_WLOCK(entry);
-	for (r = RB_MIN(secadm_rules_tree, &(entry->sp_rules));
-	    r != NULL; r = next) {
-		next = RB_NEXT(secadm_rules_tree, &(entry->sp_rules), r);
-		RB_REMOVE(secadm_rules_tree, &(entry->sp_rules), r);
-
-		kernel_free_rule(r);
-	}
-
-	entry->sp_num_rules = 0;
-	entry->sp_num_integriforce_rules = 0;
-	entry->sp_num_pax_rules = 0;
-	entry->sp_num_extended_rules = 0;
+	kernel_flush_rules(entry);
 	PE_WUNLOCK(entry);
 }
 
 int
-kernel_finalize_rule(struct thread *td, secadm_rule_t *rule, int ruleset)
+kernel_finalize_rule(struct thread *td, secadm_rule_t *rule)
 {
-	struct secadm_rules_tree *head;
-	secadm_prison_entry_t *entry;
-	secadm_rule_t *r;
 	struct vattr vap;
+	fsid_t lowerfsid;
 	int error;
 
+	memset(&(rule->sr_key), 0x00, sizeof(secadm_key_t));
+	rule->sr_key.sk_type = rule->sr_type;
+
 	switch (rule->sr_type) {
 	case secadm_integriforce_rule:
-		error = get_mntonname_vattr(td,
+		error = get_fsid_vattr(td,
 		    rule->sr_integriforce_data->si_path,
-		    rule->sr_integriforce_data->si_mntonname, &vap);
+		    &(rule->sr_key.sk_fsid), &lowerfsid, &vap);
 
 		if (error) {
 			return (error);
@@ -228,12 +732,14 @@ kernel_finalize_rule(struct thread *td, secadm_rule_t *rule, int ruleset)
 		}
 
 		rule->sr_integriforce_data->si_fileid = vap.va_fileid;
+		rule->sr_key.sk_fileid = vap.va_fileid;
+		integriforce_share(rule, &lowerfsid);
 		break;
 
 	case secadm_pax_rule:
-		error = get_mntonname_vattr(td,
+		error = get_fsid_vattr(td,
 		    rule->sr_pax_data->sp_path,
-		    rule->sr_pax_data->sp_mntonname, &vap);
+		    &(rule->sr_key.sk_fsid), NULL, &vap);
 
 		if (error) {
 			return (error);
@@ -244,6 +750,7 @@ kernel_finalize_rule(struct thread *td, secadm_rule_t *rule, int ruleset)
 		}
 
 		rule->sr_pax_data->sp_fileid = vap.va_fileid;
+		rule->sr_key.sk_fileid = vap.va_fileid;
 		break;
 
 	case secadm_extended_rule:
@@ -251,53 +758,11 @@ kernel_finalize_rule(struct thread *td, secadm_rule_t *rule, int ruleset)
 		break;
 	}
 
-	entry = get_prison_list_entry(td->td_ucred->cr_prison->pr_id);
-
-	PE_RLOCK(entry);
-	if (ruleset == 1) {
-		head = &(entry->sp_staging);
-	} else {
-		head = &(entry->sp_rules);
+	if (rule->sr_type == secadm_extended_rule) {
+		return (1);
 	}
 
-	RB_FOREACH(r, secadm_rules_tree, head) {
-		if (r->sr_type != rule->sr_type) {
-			continue;
-		}
-
-		switch (r->sr_type) {
-		case secadm_integriforce_rule:
-			if (!strncmp(r->sr_integriforce_data->si_mntonname,
-			    rule->sr_integriforce_data->si_mntonname,
-			    MAXPATHLEN) && r->sr_integriforce_data->si_fileid ==
-			    rule->sr_integriforce_data->si_fileid) {
-#ifdef SECADM_DEBUG
-				printf("[secadm debug] %s is the same as %s (or hash collision)\n", r->sr_integriforce_data->si_path,
-				    rule->sr_integriforce_data->si_path);
-#endif
-				PE_RUNLOCK(entry);
-				return (EEXIST);
-			}
-
-			break;
-
-		case secadm_pax_rule:
-			if (!strncmp(r->sr_pax_data->sp_mntonname,
-			    rule->sr_pax_data->sp_mntonname,
-			    MAXPATHLEN) && r->sr_pax_data->sp_fileid ==
-			    rule->sr_pax_data->sp_fileid) {
-				PE_RUNLOCK(entry);
-				return (EEXIST);
-			}
-
-			break;
-
-		case secadm_extended_rule:
-			PE_RUNLOCK(entry);
-			return (1);
-		}
-	}
-	PE_RUNLOCK(entry);
+	rule->sr_hash = secadm_hash(&(rule->sr_key));
 
 	return (0);
 }
@@ -305,57 +770,39 @@ kernel_finalize_rule(struct thread *td, secadm_rule_t *rule, int ruleset)
 int
 kernel_load_ruleset(struct thread *td, secadm_rule_t *rule)
 {
-	secadm_rule_t *r = rule, *r2;
+	secadm_rule_t *r = rule, r2;
 	secadm_prison_entry_t *entry;
 	int err;
 
-	r2 = malloc(sizeof(secadm_rule_t), M_SECADM, M_WAITOK);
-
 	do {
 		if ((err = kernel_add_rule(td, r, 1))) {
-			free(r2, M_SECADM);
 			goto ruleset_load_fail;
 		}
 
-		if ((err = copyin(r, r2, sizeof(secadm_rule_t)))) {
-			free(r2, M_SECADM);
+		if ((err = copyin(r, &r2, sizeof(secadm_rule_t)))) {
 			goto ruleset_load_fail;
 		}
 
-		r = r2->sr_next;
+		r = r2.sr_next;
 	} while (r != NULL);
 
-	free(r2, M_SECADM);
-
 	entry = get_prison_list_entry(td->td_ucred->cr_prison->pr_id);
-	kernel_flush_ruleset(entry->sp_id);
 
+	/*
+	 * Replace the live ruleset in one go.  The staged rules get their
+	 * IDs here, in load order, starting from zero.
+	 */
 	PE_WLOCK(entry);
-	for (r = RB_MIN(secadm_rules_tree, &(entry->sp_staging));
-	     r != NULL; r = r2) {
-		r2 = RB_NEXT(secadm_rules_tree, &(entry->sp_staging), r);
-		RB_REMOVE(secadm_rules_tree, &(entry->sp_staging), r);
-
-		r->sr_id = entry->sp_last_id++;
-		entry->sp_num_rules++;
-
-		switch (r->sr_type) {
-		case secadm_integriforce_rule:
-			entry->sp_num_integriforce_rules++;
-			break;
+	kernel_drop_rules(entry);
 
-		case secadm_pax_rule:
-			entry->sp_num_pax_rules++;
-			break;
-
-		case secadm_extended_rule:
-			entry->sp_num_extended_rules++;
-			break;
-		}
-
-		RB_INSERT(secadm_rules_tree, &(entry->sp_rules), r);
+	while ((r = TAILQ_FIRST(&(entry->sp_staging))) != NULL) {
+		TAILQ_REMOVE(&(entry->sp_staging), r, sr_entries);
+		kernel_insert_rule(entry, r);
 	}
 
+	secadm_table_destroy(&(entry->sp_staging_index));
+	kernel_publish_ruleset(entry);
+
 	entry->sp_loaded = 1;
 	PE_WUNLOCK(entry);
 
@@ -365,117 +812,152 @@ ruleset_load_fail:
 	entry = get_prison_list_entry(td->td_ucred->cr_prison->pr_id);
 
 	PE_WLOCK(entry);
-	for (r = RB_MIN(secadm_rules_tree, &(entry->sp_staging));
-	     r != NULL; r = r2) {
-		r2 = RB_NEXT(secadm_rules_tree, &(entry->sp_staging), r);
-		RB_REMOVE(secadm_rules_tree, &(entry->sp_staging), r);
-
+	while ((r = TAILQ_FIRST(&(entry->sp_staging))) != NULL) {
+		TAILQ_REMOVE(&(entry->sp_staging), r, sr_entries);
 		kernel_free_rule(r);
 	}
+
+	secadm_table_destroy(&(entry->sp_staging_index));
 	PE_WUNLOCK(entry);
 
 	return (err);
 }
 
+/*
+ * How each PaX feature of a rule maps onto the ELF note flags handed to
+ * pax_elf(9).  A feature the rule does not set leaves both flags clear.
+ */
+static const struct secadm_pax_map {
+	secadm_pax_t	spm_set;
+	secadm_pax_t	spm_value;
+	pax_flag_t	spm_on;
+	pax_flag_t	spm_off;
+} secadm_pax_map[] = {
+	{ SECADM_PAX_PAGEEXEC_SET, SECADM_PAX_PAGEEXEC,
+	    PAX_NOTE_PAGEEXEC, PAX_NOTE_NOPAGEEXEC },
+	{ SECADM_PAX_MPROTECT_SET, SECADM_PAX_MPROTECT,
+	    PAX_NOTE_MPROTECT, PAX_NOTE_NOMPROTECT },
+	{ SECADM_PAX_ASLR_SET, SECADM_PAX_ASLR,
+	    PAX_NOTE_ASLR, PAX_NOTE_NOASLR },
+	{ SECADM_PAX_SEGVGUARD_SET, SECADM_PAX_SEGVGUARD,
+	    PAX_NOTE_SEGVGUARD, PAX_NOTE_NOSEGVGUARD },
+	{ SECADM_PAX_SHLIBRANDOM_SET, SECADM_PAX_SHLIBRANDOM,
+	    PAX_NOTE_SHLIBRANDOM, PAX_NOTE_NOSHLIBRANDOM },
+	{ SECADM_PAX_MAP32_SET, SECADM_PAX_MAP32,
+	    PAX_NOTE_DISALLOWMAP32BIT, PAX_NOTE_NODISALLOWMAP32BIT },
+#ifdef PAX_NOTE_PREFER_ACL
+	{ SECADM_PAX_PREFER_ACL_SET, SECADM_PAX_PREFER_ACL,
+	    PAX_NOTE_PREFER_ACL, 0 },
+#endif
+};
+
+static pax_flag_t
+kernel_pax_flags(secadm_pax_data_t *data)
+{
+	const struct secadm_pax_map *m;
+	pax_flag_t flags;
+	int i;
+
+	flags = 0;
+
+	for (i = 0; i < nitems(secadm_pax_map); i++) {
+		m = &(secadm_pax_map[i]);
+
+		if (data->sp_pax_set & m->spm_set) {
+			flags |= (data->sp_pax & m->spm_value) ?
+			    m->spm_on : m->spm_off;
+		}
+	}
+
+	return (flags);
+}
+
+/*
+ * Copy in a user supplied path of pathsz bytes and intern it.
+ */
+static u_char *
+kernel_copyin_path(u_char *upath, size_t pathsz)
+{
+	u_char *buf, *path;
+
+	buf = malloc(pathsz, M_SECADM, M_WAITOK);
+
+	if (copyin(upath, buf, pathsz)) {
+		free(buf, M_SECADM);
+		return (NULL);
+	}
+
+	path = secadm_intern(buf, pathsz);
+	free(buf, M_SECADM);
+
+	return (path);
+}
+
 int
 kernel_add_rule(struct thread *td, secadm_rule_t *rule, int ruleset)
 {
+	secadm_integriforce_data_t idata;
 	secadm_prison_entry_t *entry;
+	secadm_pax_data_t pdata;
+	secadm_rule_t hdr, *r, *v;
+	secadm_file_t *f;
+	secadm_key_t *k;
 	u_char *path, *hash;
-	secadm_key_t key;
-	secadm_rule_t *r;
-	void *ptr;
+	size_t hashsz;
 	int error;
 
-	r = malloc(sizeof(secadm_rule_t), M_SECADM, M_WAITOK | M_ZERO);
-
-	if (copyin(rule, r, sizeof(secadm_rule_t))) {
-		free(r, M_SECADM);
+	if (copyin(rule, &hdr, sizeof(secadm_rule_t))) {
 		return (EINVAL);
 	}
 
-	switch (r->sr_type) {
+	/* Validate the user's data before allocating anything. */
+	switch (hdr.sr_type) {
 	case secadm_integriforce_rule:
-		ptr = malloc(sizeof(secadm_integriforce_data_t),
-		    M_SECADM, M_WAITOK);
-
-		if (copyin(r->sr_integriforce_data, ptr,
+		if (copyin(hdr.sr_integriforce_data, &idata,
 		    sizeof(secadm_integriforce_data_t))) {
-			r->sr_integriforce_data = NULL;
-			free(ptr, M_SECADM);
-			free(r, M_SECADM);
-
-			return (EINVAL);
-		}
-
-		r->sr_integriforce_data = ptr;
-
-		if (r->sr_integriforce_data->si_pathsz == 0 ||
-		    r->sr_integriforce_data->si_pathsz >= MAXPATHLEN) {
-			memset(r->sr_integriforce_data, 0x00,
-			    sizeof(secadm_integriforce_data_t));
-			kernel_free_rule(r);
-
 			return (EINVAL);
 		}
 
-		path = malloc(r->sr_integriforce_data->si_pathsz + 1,
-		    M_SECADM, M_WAITOK);
-
-		if (copyin(r->sr_integriforce_data->si_path, path,
-		    r->sr_integriforce_data->si_pathsz)) {
-			memset(r->sr_integriforce_data, 0x00,
-			    sizeof(secadm_integriforce_data_t));
-			free(path, M_SECADM);
-			kernel_free_rule(r);
-
+		if (idata.si_pathsz == 0 || idata.si_pathsz >= MAXPATHLEN) {
 			return (EINVAL);
 		}
 
-		path[r->sr_integriforce_data->si_pathsz] = '\0';
-		r->sr_integriforce_data->si_path = path;
-
-		switch (r->sr_integriforce_data->si_type) {
+		switch (idata.si_type) {
 		case secadm_hash_sha1:
-			hash = malloc(SECADM_SHA1_DIGEST_LEN,
-			    M_SECADM, M_WAITOK);
-
-			if (copyin(r->sr_integriforce_data->si_hash, hash,
-			    SECADM_SHA1_DIGEST_LEN)) {
-				r->sr_integriforce_data->si_hash = NULL;
-				free(hash, M_SECADM);
-				kernel_free_rule(r);
-
-				return (EINVAL);
-			}
-
+			hashsz = SECADM_SHA1_DIGEST_LEN;
 			break;
 
 		case secadm_hash_sha256:
-			hash = malloc(SECADM_SHA256_DIGEST_LEN,
-			    M_SECADM, M_WAITOK);
-
-			if (copyin(r->sr_integriforce_data->si_hash, hash,
-			    SECADM_SHA256_DIGEST_LEN)) {
-				r->sr_integriforce_data->si_hash = NULL;
-				free(hash, M_SECADM);
-				kernel_free_rule(r);
-
-				return (EINVAL);
-			}
+			hashsz = SECADM_SHA256_DIGEST_LEN;
+			break;
 
+		case secadm_hash_blake3:
+			hashsz = SECADM_BLAKE3_DIGEST_LEN;
 			break;
 
 		default:
-			kernel_free_rule(r);
 			return (EINVAL);
 		}
 
+		if (!(idata.si_mode == 0 || idata.si_mode == 1)) {
+			return (EINVAL);
+		}
+
+		if ((path = kernel_copyin_path(idata.si_path,
+		    idata.si_pathsz)) == NULL) {
+			return (EINVAL);
+		}
+
+		r = kernel_alloc_rule(secadm_integriforce_rule);
+		hash = r->sr_integriforce_data->si_hash;
+
+		memcpy(r->sr_integriforce_data, &idata,
+		    sizeof(secadm_integriforce_data_t));
+		r->sr_integriforce_data->si_path = path;
 		r->sr_integriforce_data->si_hash = hash;
 		r->sr_integriforce_data->si_cache = 0;
 
-		if (!(r->sr_integriforce_data->si_mode == 0 ||
-		    r->sr_integriforce_data->si_mode == 1)) {
+		if (copyin(idata.si_hash, hash, hashsz)) {
 			kernel_free_rule(r);
 			return (EINVAL);
 		}
@@ -483,44 +965,27 @@ kernel_add_rule(struct thread *td, secadm_rule_t *rule, int ruleset)
 		break;
 
 	case secadm_pax_rule:
-		ptr = malloc(sizeof(secadm_pax_data_t), M_SECADM, M_WAITOK);
-
-		if (copyin(r->sr_pax_data, ptr,
+		if (copyin(hdr.sr_pax_data, &pdata,
 		    sizeof(secadm_pax_data_t))) {
-			free(ptr, M_SECADM);
-			free(r, M_SECADM);
-
 			return (EINVAL);
 		}
 
-		r->sr_pax_data = ptr;
-
-		if (!(r->sr_pax_data->sp_pax_set)) {
-			r->sr_pax_data->sp_path = NULL;
-			kernel_free_rule(r);
+		if (!(pdata.sp_pax_set)) {
 			return (EINVAL);
 		}
 
-		if (r->sr_pax_data->sp_pathsz == 0 ||
-		    r->sr_pax_data->sp_pathsz >= MAXPATHLEN) {
-			r->sr_pax_data->sp_path = NULL;
-			kernel_free_rule(r);
+		if (pdata.sp_pathsz == 0 || pdata.sp_pathsz >= MAXPATHLEN) {
 			return (EINVAL);
 		}
 
-		path = malloc(r->sr_pax_data->sp_pathsz + 1,
-		    M_SECADM, M_WAITOK);
-
-		if (copyin(r->sr_pax_data->sp_path, path,
-		    r->sr_pax_data->sp_pathsz)) {
-			r->sr_pax_data->sp_path = NULL;
-			free(path, M_SECADM);
-			kernel_free_rule(r);
-
+		if ((path = kernel_copyin_path(pdata.sp_path,
+		    pdata.sp_pathsz)) == NULL) {
 			return (EINVAL);
 		}
 
-		path[r->sr_pax_data->sp_pathsz] = '\0';
+		r = kernel_alloc_rule(secadm_pax_rule);
+
+		memcpy(r->sr_pax_data, &pdata, sizeof(secadm_pax_data_t));
 		r->sr_pax_data->sp_path = path;
 
 		if (r->sr_pax_data->sp_pax_set &
@@ -544,24 +1009,20 @@ kernel_add_rule(struct thread *td, secadm_rule_t *rule, int ruleset)
 			}
 		}
 
+		r->sr_pax_flags = kernel_pax_flags(r->sr_pax_data);
+
 		break;
 
 	case secadm_extended_rule:
-		r->sr_extended_data = NULL;
 		printf("bsdextended rules not supported yet.\n");
 
 	default:
-		kernel_free_rule(r);
 		return (EINVAL);
 	}
 
-	if ((error = kernel_finalize_rule(td, r, ruleset))) {
-		if (r->sr_type == secadm_integriforce_rule) {
-			if (error == EEXIST) {
-				error = 0;
-			}
-		}
+	refcount_init(&(r->sr_refs), 1);
 
+	if ((error = kernel_finalize_rule(td, r))) {
 		kernel_free_rule(r);
 		return (error);
 	}
@@ -569,55 +1030,59 @@ kernel_add_rule(struct thread *td, secadm_rule_t *rule, int ruleset)
 	r->sr_active = 1;
 	r->sr_jid = td->td_ucred->cr_prison->pr_id;
 
-	switch (r->sr_type) {
-	case secadm_integriforce_rule:
-		key.sk_jid = r->sr_jid;
-		key.sk_type = secadm_integriforce_rule;
-		key.sk_fileid = r->sr_integriforce_data->si_fileid;
-		strncpy(key.sk_mntonname,
-		    r->sr_integriforce_data->si_mntonname, MNAMELEN);
-
-		break;
-
-	case secadm_pax_rule:
-		key.sk_jid = r->sr_jid;
-		key.sk_type = secadm_pax_rule;
-		key.sk_fileid = r->sr_pax_data->sp_fileid;
-		strncpy(key.sk_mntonname,
-		    r->sr_pax_data->sp_mntonname, MNAMELEN);
-
-		break;
-
-	case secadm_extended_rule:
-		kernel_free_rule(r);
-		return (EINVAL);
-	}
-
-	r->sr_key = fnv_32_buf(&key, sizeof(secadm_key_t), FNV1_32_INIT);
 	entry = get_prison_list_entry(td->td_ucred->cr_prison->pr_id);
 
+	/*
+	 * Duplicates are found by key in the staging or live index, under
+	 * the same exclusive hold as the insert, so loading n rules costs
+	 * O(n) and two concurrent adds cannot both get in.
+	 */
 	PE_WLOCK(entry);
+	v = NULL;
 	if (ruleset == 1) {
-		RB_INSERT(secadm_rules_tree, &(entry->sp_staging), r);
-	} else {
-		r->sr_id = entry->sp_last_id++;
-		entry->sp_num_rules++;
+		k = secadm_table_lookup(&(entry->sp_staging_index),
+		    &(r->sr_key), r->sr_hash);
+		if (k != NULL) {
+			v = __containerof(k, secadm_rule_t, sr_key);
+		}
+	} else if ((f = kernel_lookup_file(entry->sp_ruleset,
+	    &(r->sr_key))) != NULL) {
+		if (r->sr_type == secadm_integriforce_rule) {
+			v = f->sfi_integriforce;
+		} else {
+			v = f->sfi_pax;
+		}
+	}
 
-		switch (r->sr_type) {
-		case secadm_integriforce_rule:
-			entry->sp_num_integriforce_rules++;
-			break;
+	if (v != NULL) {
+		PE_WUNLOCK(entry);
 
-		case secadm_pax_rule:
-			entry->sp_num_pax_rules++;
-			break;
+#ifdef SECADM_DEBUG
+		if (r->sr_type == secadm_integriforce_rule) {
+			printf("[secadm debug] %s is the same as %s\n",
+			    v->sr_integriforce_data->si_path,
+			    r->sr_integriforce_data->si_path);
+		}
+#endif
 
-		case secadm_extended_rule:
-			entry->sp_num_extended_rules++;
-			break;
+		/* Repeated Integriforce entries for a file are tolerated. */
+		if (r->sr_type == secadm_integriforce_rule) {
+			error = 0;
+		} else {
+			error = EEXIST;
 		}
 
-		RB_INSERT(secadm_rules_tree, &(entry->sp_rules), r);
+		kernel_free_rule(r);
+		return (error);
+	}
+
+	if (ruleset == 1) {
+		TAILQ_INSERT_TAIL(&(entry->sp_staging), r, sr_entries);
+		secadm_table_insert(&(entry->sp_staging_index), &(r->sr_key),
+		    r->sr_hash);
+	} else {
+		kernel_insert_rule(entry, r);
+		kernel_publish_ruleset(entry);
 	}
 	PE_WUNLOCK(entry);
 
@@ -628,12 +1093,9 @@ void
 kernel_del_rule(struct thread *td, secadm_rule_t *rule)
 {
 	secadm_prison_entry_t *entry;
-	secadm_rule_t *r, *v, *next;
+	secadm_rule_t r, *v;
 
-	r = malloc(sizeof(secadm_rule_t), M_SECADM, M_WAITOK);
-
-	if (copyin(rule, r, sizeof(secadm_rule_t))) {
-		kernel_free_rule(r);
+	if (copyin(rule, &r, sizeof(secadm_rule_t))) {
 		return;
 	}
 
@@ -641,47 +1103,20 @@ kernel_del_rule(struct thread *td, secadm_rule_t *rule)
 	    td->td_ucred->cr_prison->pr_id);
 
 	PE_WLOCK(entry);
-	for (v = RB_MIN(secadm_rules_tree, &(entry->sp_rules));
-	    v != NULL; v = next) {
-		next = RB_NEXT(secadm_rules_tree, &(entry->sp_rules), v);
-
-		if (r->sr_id == v->sr_id) {
-			RB_REMOVE(secadm_rules_tree, &(entry->sp_rules), v);
-			entry->sp_num_rules--;
-
-			switch (v->sr_type) {
-			case secadm_integriforce_rule:
-				entry->sp_num_integriforce_rules--;
-				break;
-
-			case secadm_extended_rule:
-				entry->sp_num_extended_rules--;
-				break;
-
-			case secadm_pax_rule:
-				entry->sp_num_pax_rules--;
-				break;
-			}
-
-			kernel_free_rule(v);
-			break;
-		}
+	if ((v = kernel_get_rule(entry, r.sr_id, 0)) != NULL) {
+		kernel_remove_rule(entry, v);
+		kernel_publish_ruleset(entry);
 	}
 	PE_WUNLOCK(entry);
-
-	free(r, M_SECADM);
 }
 
 void
 kernel_active_rule(struct thread *td, secadm_rule_t *rule, int active)
 {
 	secadm_prison_entry_t *entry;
-	secadm_rule_t *r, *v;
-
-	r = malloc(sizeof(secadm_rule_t), M_SECADM, M_WAITOK);
+	secadm_rule_t r, *v;
 
-	if (copyin(rule, r, sizeof(secadm_rule_t))) {
-		kernel_free_rule(r);
+	if (copyin(rule, &r, sizeof(secadm_rule_t))) {
 		return;
 	}
 
@@ -689,48 +1124,34 @@ kernel_active_rule(struct thread *td, secadm_rule_t *rule, int active)
 	    td->td_ucred->cr_prison->pr_id);
 
 	PE_WLOCK(entry);
-	RB_FOREACH(v, secadm_rules_tree, &(entry->sp_rules)) {
-		if (r->sr_id == v->sr_id) {
-			v->sr_active = active;
-			break;
-		}
+	if ((v = kernel_get_rule(entry, r.sr_id, 0)) != NULL) {
+		atomic_store_rel_int((volatile u_int *)&(v->sr_active),
+		    active);
+		kernel_bump_generation(entry);
 	}
 	PE_WUNLOCK(entry);
-
-	free(r, M_SECADM);
 }
 
+/*
+ * Return the rule with the given ID or, if next is set, the first rule
+ * whose ID is not below it.  The caller holds the prison entry locked
+ * for as long as it uses the rule.
+ */
 secadm_rule_t *
-kernel_get_rule(struct thread *td, secadm_rule_t *rule)
+kernel_get_rule(secadm_prison_entry_t *entry, int id, int next)
 {
-	secadm_prison_entry_t *entry;
-	secadm_rule_t *r, *v;
-	int found = 0;
 
-	r = malloc(sizeof(secadm_rule_t), M_SECADM, M_WAITOK);
-
-	if (copyin(rule, r, sizeof(secadm_rule_t))) {
-		kernel_free_rule(r);
+	if (id < 0 || id >= entry->sp_ids_size) {
 		return (NULL);
 	}
 
-	entry = get_prison_list_entry(
-	    td->td_ucred->cr_prison->pr_id);
+	if (next) {
+		bit_ffs_at(entry->sp_idmap, id, entry->sp_ids_size, &id);
 
-	PE_RLOCK(entry);
-	RB_FOREACH(v, secadm_rules_tree, &(entry->sp_rules)) {
-		if (v->sr_id == r->sr_id) {
-			found = 1;
-			break;
+		if (id == -1) {
+			return (NULL);
 		}
 	}
-	PE_RUNLOCK(entry);
-
-	free(r, M_SECADM);
-
-	if (found) {
-		return (v);
-	}
 
-	return (NULL);
+	return (entry->sp_ids[id]);
 }
@@ -0,0 +1,278 @@
+/*-
+ * Copyright (c) 2026 The HardenedBSD Project
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * BLAKE3 in plain hash mode with the default 32-byte output.
+ *
+ * Input is split into 1 KB chunks, each compressed block by block into
+ * a chaining value, and the chaining values are merged pairwise into a
+ * binary tree whose root gives the digest.  This follows the portable
+ * reference implementation: one chunk at a time, with the pending left
+ * subtrees kept on a stack that is merged as each chunk completes.  The
+ * tree only changes the order of work, not the result, so the digest is
+ * the same as what b3sum(1) prints.
+ */
+
+#include <sys/param.h>
+
+#include <sys/endian.h>
+#include <sys/epoch.h>
+#include <sys/kernel.h>
+#include <sys/libkern.h>
+#include <sys/lock.h>
+#include <sys/mount.h>
+#include <sys/sx.h>
+#include <sys/systm.h>
+
+#include "secadm.h"
+
+#define	BLAKE3_CHUNK_START	(1 << 0)
+#define	BLAKE3_CHUNK_END	(1 << 1)
+#define	BLAKE3_PARENT		(1 << 2)
+#define	BLAKE3_ROOT		(1 << 3)
+
+static const uint32_t blake3_iv[8] = {
+	0x6a09e667U, 0xbb67ae85U, 0x3c6ef372U, 0xa54ff53aU,
+	0x510e527fU, 0x9b05688cU, 0x1f83d9abU, 0x5be0cd19U
+};
+
+static const uint8_t blake3_schedule[7][16] = {
+	{  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15 },
+	{  2,  6,  3, 10,  7,  0,  4, 13,  1, 11, 12,  5,  9, 14, 15,  8 },
+	{  3,  4, 10, 12, 13,  2,  7, 14,  6,  5,  9,  0, 11, 15,  8,  1 },
+	{ 10,  7, 12,  9, 14,  3, 13, 15,  4,  0, 11,  2,  5,  8,  1,  6 },
+	{ 12, 13,  9, 11, 15, 10, 14,  8,  7,  2,  5,  3,  0,  1,  6,  4 },
+	{  9, 14, 11,  5,  8, 12, 15,  1, 13,  3,  0, 10,  2,  6,  4,  7 },
+	{ 11, 15,  5,  0,  1,  9,  8,  6, 14, 10,  2, 12,  3,  4,  7, 13 }
+};
+
+static inline uint32_t
+blake3_rotr(uint32_t x, int n)
+{
+
+	return ((x >> n) | (x << (32 - n)));
+}
+
+static inline void
+blake3_g(uint32_t *s, int a, int b, int c, int d, uint32_t x, uint32_t y)
+{
+
+	s[a] = s[a] + s[b] + x;
+	s[d] = blake3_rotr(s[d] ^ s[a], 16);
+	s[c] = s[c] + s[d];
+	s[b] = blake3_rotr(s[b] ^ s[c], 12);
+	s[a] = s[a] + s[b] + y;
+	s[d] = blake3_rotr(s[d] ^ s[a], 8);
+	s[c] = s[c] + s[d];
+	s[b] = blake3_rotr(s[b] ^ s[c], 7);
+}
+
+/*
+ * Compress one block into cv.  The message schedule is precomputed per
+ * round rather than permuting the block words in between.
+ */
+static void
+blake3_compress(uint32_t cv[8], const uint8_t block[SECADM_BLAKE3_BLOCK_LEN],
+    uint8_t block_len, uint64_t counter, uint8_t flags)
+{
+	const uint8_t *sc;
+	uint32_t m[16], s[16];
+	int i;
+
+	for (i = 0; i < 16; i++)
+		m[i] = le32dec(block + i * 4);
+
+	memcpy(s, cv, 8 * sizeof(uint32_t));
+	memcpy(s + 8, blake3_iv, 4 * sizeof(uint32_t));
+	s[12] = (uint32_t)counter;
+	s[13] = (uint32_t)(counter >> 32);
+	s[14] = block_len;
+	s[15] = flags;
+
+	for (i = 0; i < 7; i++) {
+		sc = blake3_schedule[i];
+
+		blake3_g(s, 0, 4,  8, 12, m[sc[0]], m[sc[1]]);
+		blake3_g(s, 1, 5,  9, 13, m[sc[2]], m[sc[3]]);
+		blake3_g(s, 2, 6, 10, 14, m[sc[4]], m[sc[5]]);
+		blake3_g(s, 3, 7, 11, 15, m[sc[6]], m[sc[7]]);
+		blake3_g(s, 0, 5, 10, 15, m[sc[8]], m[sc[9]]);
+		blake3_g(s, 1, 6, 11, 12, m[sc[10]], m[sc[11]]);
+		blake3_g(s, 2, 7,  8, 13, m[sc[12]], m[sc[13]]);
+		blake3_g(s, 3, 4,  9, 14, m[sc[14]], m[sc[15]]);
+	}
+
+	for (i = 0; i < 8; i++)
+		cv[i] = s[i] ^ s[i + 8];
+}
+
+static void
+blake3_chunk_reset(secadm_blake3_ctx_t *ctx, uint64_t counter)
+{
+
+	memcpy(ctx->sb_cv, blake3_iv, sizeof(ctx->sb_cv));
+	ctx->sb_chunk = counter;
+	ctx->sb_block_len = 0;
+	ctx->sb_blocks = 0;
+}
+
+static inline uint8_t
+blake3_chunk_start(secadm_blake3_ctx_t *ctx)
+{
+
+	return (ctx->sb_blocks == 0 ? BLAKE3_CHUNK_START : 0);
+}
+
+/* Merge two subtrees.  parent holds the left one and gets the result. */
+static void
+blake3_parent(uint32_t parent[8], const uint32_t right[8], uint8_t flags)
+{
+	uint8_t block[SECADM_BLAKE3_BLOCK_LEN];
+	int i;
+
+	for (i = 0; i < 8; i++) {
+		le32enc(block + i * 4, parent[i]);
+		le32enc(block + 32 + i * 4, right[i]);
+	}
+
+	memcpy(parent, blake3_iv, 8 * sizeof(uint32_t));
+	blake3_compress(parent, block, SECADM_BLAKE3_BLOCK_LEN, 0,
+	    BLAKE3_PARENT | flags);
+}
+
+/*
+ * A chunk is done: fold its chaining value into the stack.  Every
+ * trailing zero bit of the number of chunks so far is a completed
+ * subtree to merge with.
+ */
+static void
+blake3_push_chunk(secadm_blake3_ctx_t *ctx)
+{
+	uint32_t cv[8];
+	uint64_t total;
+
+	blake3_compress(ctx->sb_cv, ctx->sb_block, ctx->sb_block_len,
+	    ctx->sb_chunk, blake3_chunk_start(ctx) | BLAKE3_CHUNK_END);
+	memcpy(cv, ctx->sb_cv, sizeof(cv));
+
+	total = ctx->sb_chunk + 1;
+	while ((total & 1) == 0) {
+		ctx->sb_depth--;
+		blake3_parent(ctx->sb_stack[ctx->sb_depth], cv, 0);
+		memcpy(cv, ctx->sb_stack[ctx->sb_depth], sizeof(cv));
+		total >>= 1;
+	}
+
+	memcpy(ctx->sb_stack[ctx->sb_depth], cv, sizeof(cv));
+	ctx->sb_depth++;
+
+	blake3_chunk_reset(ctx, ctx->sb_chunk + 1);
+}
+
+void
+secadm_blake3_init(secadm_blake3_ctx_t *ctx)
+{
+
+	memset(ctx, 0x00, sizeof(secadm_blake3_ctx_t));
+	blake3_chunk_reset(ctx, 0);
+}
+
+void
+secadm_blake3_update(secadm_blake3_ctx_t *ctx, const void *data, size_t len)
+{
+	const uint8_t *p;
+	size_t amt;
+
+	p = data;
+
+	while (len > 0) {
+		/*
+		 * A full block is only compressed once more input shows it
+		 * is not the chunk's last, which is flagged differently.
+		 */
+		if (ctx->sb_block_len == SECADM_BLAKE3_BLOCK_LEN) {
+			if (ctx->sb_blocks == SECADM_BLAKE3_CHUNK_BLOCKS - 1) {
+				blake3_push_chunk(ctx);
+			} else {
+				blake3_compress(ctx->sb_cv, ctx->sb_block,
+				    SECADM_BLAKE3_BLOCK_LEN, ctx->sb_chunk,
+				    blake3_chunk_start(ctx));
+				ctx->sb_blocks++;
+				ctx->sb_block_len = 0;
+			}
+		}
+
+		amt = MIN(len, SECADM_BLAKE3_BLOCK_LEN - ctx->sb_block_len);
+		memcpy(ctx->sb_block + ctx->sb_block_len, p, amt);
+		ctx->sb_block_len += amt;
+		p += amt;
+		len -= amt;
+	}
+}
+
+void
+secadm_blake3_final(secadm_blake3_ctx_t *ctx,
+    u_char digest[SECADM_BLAKE3_DIGEST_LEN])
+{
+	uint32_t cv[8], right[8];
+	uint8_t flags;
+	int depth, i;
+
+	/* The last, possibly short, block of the last chunk. */
+	memset(ctx->sb_block + ctx->sb_block_len, 0x00,
+	    SECADM_BLAKE3_BLOCK_LEN - ctx->sb_block_len);
+	memcpy(cv, ctx->sb_cv, sizeof(cv));
+	flags = blake3_chunk_start(ctx) | BLAKE3_CHUNK_END;
+
+	/*
+	 * Merge up the stack.  Whichever compression ends up at the top of
+	 * the tree is done again with the ROOT flag to produce the digest.
+	 */
+	for (depth = ctx->sb_depth; depth > 0; depth--) {
+		blake3_compress(cv, ctx->sb_block, ctx->sb_block_len,
+		    ctx->sb_chunk, flags);
+
+		memcpy(right, cv, sizeof(right));
+		memcpy(cv, blake3_iv, sizeof(cv));
+		for (i = 0; i < 8; i++) {
+			le32enc(ctx->sb_block + i * 4,
+			    ctx->sb_stack[depth - 1][i]);
+			le32enc(ctx->sb_block + 32 + i * 4, right[i]);
+		}
+
+		ctx->sb_block_len = SECADM_BLAKE3_BLOCK_LEN;
+		ctx->sb_chunk = 0;
+		flags = BLAKE3_PARENT;
+	}
+
+	blake3_compress(cv, ctx->sb_block, ctx->sb_block_len, ctx->sb_chunk,
+	    flags | BLAKE3_ROOT);
+
+	for (i = 0; i < 8; i++)
+		le32enc(digest + i * 4, cv[i]);
+
+	explicit_bzero(ctx, sizeof(secadm_blake3_ctx_t));
+}
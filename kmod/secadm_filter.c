@@ -0,0 +1,210 @@
+/*-
+ * Copyright (c) 2026 The HardenedBSD Project
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Negative lookup filter.
+ *
+ * A split block Bloom filter over the (fsid, fileid) of every file a
+ * ruleset has rules for.  A key selects one 32-byte block and sets one
+ * bit in each of its eight words, so a query costs a single cache line.
+ * Most files have no rule, and for those the hooks stop here instead of
+ * running SipHash and probing the file table.
+ *
+ * The filter is built once per ruleset and is never modified, so it can
+ * be read from within the ruleset's epoch section like the rest of it.
+ */
+
+#include <sys/param.h>
+
+#include <sys/counter.h>
+#include <sys/epoch.h>
+#include <sys/kernel.h>
+#include <sys/libkern.h>
+#include <sys/lock.h>
+#include <sys/malloc.h>
+#include <sys/mount.h>
+#include <sys/sx.h>
+#include <sys/sysctl.h>
+#include <sys/systm.h>
+
+#include "secadm.h"
+
+/* Well under 1% false positives at this density. */
+#define	FILTER_BITS_PER_KEY	16
+#define	FILTER_BLOCK_BITS	(SECADM_FILTER_WORDS * 32)
+
+static const uint32_t filter_salt[SECADM_FILTER_WORDS] = {
+	0x47b6137bU, 0x44974d91U, 0x8824ad5bU, 0xa2b7289dU,
+	0x705495c7U, 0x2df1424bU, 0x9efc4947U, 0x5c6bfb31U
+};
+
+static counter_u64_t secadm_filter_hits;
+static counter_u64_t secadm_filter_misses;
+static counter_u64_t secadm_filter_false_positives;
+
+SYSCTL_DECL(_hardening_secadm);
+
+SYSCTL_NODE(_hardening_secadm, OID_AUTO, filter, CTLFLAG_RD, 0,
+    "secadm negative lookup filter");
+
+SYSCTL_COUNTER_U64(_hardening_secadm_filter, OID_AUTO, hits, CTLFLAG_RD,
+    &secadm_filter_hits, "Lookups the filter let through");
+SYSCTL_COUNTER_U64(_hardening_secadm_filter, OID_AUTO, misses, CTLFLAG_RD,
+    &secadm_filter_misses, "Lookups the filter answered on its own");
+SYSCTL_COUNTER_U64(_hardening_secadm_filter, OID_AUTO, false_positives,
+    CTLFLAG_RD, &secadm_filter_false_positives,
+    "Execs the filter let through that matched no rule");
+
+/*
+ * A cheap, seeded mix of the file identity.  It does not need to stand
+ * up to crafted keys: a collision only costs the lookup the filter was
+ * meant to save.
+ */
+static inline uint64_t
+filter_mix(secadm_filter_t *filter, secadm_key_t *key)
+{
+	uint64_t h;
+
+	h = ((uint64_t)(uint32_t)key->sk_fsid.val[0] << 32 |
+	    (uint32_t)key->sk_fsid.val[1]) ^ filter->sf_seed;
+	h ^= (uint64_t)key->sk_fileid * 0x9e3779b97f4a7c15ULL;
+
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+
+	return (h);
+}
+
+static inline struct secadm_filter_block *
+filter_block(secadm_filter_t *filter, uint64_t h)
+{
+
+	return (&(filter->sf_blocks[((h >> 32) * filter->sf_nblocks) >> 32]));
+}
+
+static inline uint32_t
+filter_bit(uint64_t h, int word)
+{
+
+	return (1U << (((uint32_t)h * filter_salt[word]) >> 27));
+}
+
+void
+secadm_filter_init(void)
+{
+
+	secadm_filter_hits = counter_u64_alloc(M_WAITOK);
+	secadm_filter_misses = counter_u64_alloc(M_WAITOK);
+	secadm_filter_false_positives = counter_u64_alloc(M_WAITOK);
+}
+
+void
+secadm_filter_uninit(void)
+{
+
+	counter_u64_free(secadm_filter_hits);
+	counter_u64_free(secadm_filter_misses);
+	counter_u64_free(secadm_filter_false_positives);
+}
+
+void
+secadm_filter_build(secadm_filter_t *filter, secadm_file_t *files,
+    size_t nfiles)
+{
+	struct secadm_filter_block *block;
+	uint64_t h;
+	size_t i;
+	int w;
+
+	memset(filter, 0x00, sizeof(secadm_filter_t));
+
+	if (nfiles == 0)
+		return;
+
+	filter->sf_seed = (uint64_t)arc4random() << 32 | arc4random();
+	filter->sf_nblocks = howmany(nfiles * FILTER_BITS_PER_KEY,
+	    FILTER_BLOCK_BITS);
+	filter->sf_blocks = mallocarray(filter->sf_nblocks,
+	    sizeof(struct secadm_filter_block), M_SECADM, M_WAITOK | M_ZERO);
+
+	for (i = 0; i < nfiles; i++) {
+		h = filter_mix(filter, &(files[i].sfi_key));
+		block = filter_block(filter, h);
+
+		for (w = 0; w < SECADM_FILTER_WORDS; w++)
+			block->sfb_words[w] |= filter_bit(h, w);
+	}
+}
+
+void
+secadm_filter_destroy(secadm_filter_t *filter)
+{
+
+	if (filter->sf_nblocks)
+		free(filter->sf_blocks, M_SECADM);
+
+	memset(filter, 0x00, sizeof(secadm_filter_t));
+}
+
+/*
+ * Returns 0 if no rule of any type can exist for the file, 1 if one
+ * may.  Only the fsid and fileid of the key are looked at.
+ */
+int
+secadm_filter_query(secadm_filter_t *filter, secadm_key_t *key)
+{
+	struct secadm_filter_block *block;
+	uint64_t h;
+	int w;
+
+	if (filter->sf_nblocks == 0) {
+		counter_u64_add(secadm_filter_misses, 1);
+		return (0);
+	}
+
+	h = filter_mix(filter, key);
+	block = filter_block(filter, h);
+
+	for (w = 0; w < SECADM_FILTER_WORDS; w++) {
+		if ((block->sfb_words[w] & filter_bit(h, w)) == 0) {
+			counter_u64_add(secadm_filter_misses, 1);
+			return (0);
+		}
+	}
+
+	counter_u64_add(secadm_filter_hits, 1);
+	return (1);
+}
+
+void
+secadm_filter_false_positive(void)
+{
+
+	counter_u64_add(secadm_filter_false_positives, 1);
+}
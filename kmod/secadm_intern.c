@@ -0,0 +1,218 @@
+/*-
+ * Copyright (c) 2026 The HardenedBSD Project
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * Interned rule paths.
+ *
+ * Rule records keep a pointer to a shared, reference counted copy of
+ * their path, so the same file named by a PaX and an Integriforce rule,
+ * or by the live and the staged ruleset during a load, is stored once.
+ * Paths are only read when reporting rules and in log messages, so they
+ * live apart from the records the hooks look at.
+ */
+
+#include <sys/param.h>
+
+#include <sys/epoch.h>
+#include <sys/fnv_hash.h>
+#include <sys/kernel.h>
+#include <sys/libkern.h>
+#include <sys/lock.h>
+#include <sys/malloc.h>
+#include <sys/mount.h>
+#include <sys/mutex.h>
+#include <sys/queue.h>
+#include <sys/sx.h>
+#include <sys/systm.h>
+
+#include "secadm.h"
+
+#define	INTERN_MIN_BUCKETS	64
+
+struct secadm_istr {
+	LIST_ENTRY(secadm_istr)	 is_entries;
+	uint32_t		 is_hash;
+	u_int			 is_refs;
+	size_t			 is_len;
+	u_char			 is_str[];
+};
+
+LIST_HEAD(secadm_istr_list, secadm_istr);
+
+static struct mtx		 intern_mtx;
+static struct secadm_istr_list	*intern_buckets;
+static u_long			 intern_mask;
+static size_t			 intern_count;
+
+void
+secadm_intern_init(void)
+{
+
+	mtx_init(&intern_mtx, "secadm intern", NULL, MTX_DEF);
+	intern_buckets = hashinit(INTERN_MIN_BUCKETS, M_SECADM, &intern_mask);
+}
+
+void
+secadm_intern_uninit(void)
+{
+
+	KASSERT(intern_count == 0,
+	    ("secadm: %zu interned paths left at unload", intern_count));
+
+	hashdestroy(intern_buckets, M_SECADM, intern_mask);
+	mtx_destroy(&intern_mtx);
+}
+
+/*
+ * Double the bucket array once the chains average more than one entry.
+ * The new array is allocated with the lock dropped; if someone else
+ * resized in the meantime it is thrown away.
+ */
+static void
+intern_grow(void)
+{
+	struct secadm_istr_list *buckets, *old;
+	struct secadm_istr *is;
+	u_long mask, oldmask, i;
+
+	oldmask = intern_mask;
+	mtx_unlock(&intern_mtx);
+	buckets = hashinit((oldmask + 1) * 2, M_SECADM, &mask);
+	mtx_lock(&intern_mtx);
+
+	if (intern_mask != oldmask) {
+		mtx_unlock(&intern_mtx);
+		hashdestroy(buckets, M_SECADM, mask);
+		mtx_lock(&intern_mtx);
+		return;
+	}
+
+	old = intern_buckets;
+	for (i = 0; i <= oldmask; i++) {
+		while ((is = LIST_FIRST(&(old[i]))) != NULL) {
+			LIST_REMOVE(is, is_entries);
+			LIST_INSERT_HEAD(&(buckets[is->is_hash & mask]), is,
+			    is_entries);
+		}
+	}
+
+	intern_buckets = buckets;
+	intern_mask = mask;
+
+	mtx_unlock(&intern_mtx);
+	hashdestroy(old, M_SECADM, oldmask);
+	mtx_lock(&intern_mtx);
+}
+
+static struct secadm_istr *
+intern_find(const u_char *str, size_t len, uint32_t hash)
+{
+	struct secadm_istr *is;
+
+	LIST_FOREACH(is, &(intern_buckets[hash & intern_mask]), is_entries) {
+		if (is->is_hash == hash && is->is_len == len &&
+		    !memcmp(is->is_str, str, len)) {
+			return (is);
+		}
+	}
+
+	return (NULL);
+}
+
+/*
+ * Return a NUL terminated shared copy of the len bytes at str, taking a
+ * reference on it.  May sleep.
+ */
+u_char *
+secadm_intern(const u_char *str, size_t len)
+{
+	struct secadm_istr *is, *new;
+	uint32_t hash;
+
+	hash = fnv_32_buf(str, len, FNV1_32_INIT);
+
+	mtx_lock(&intern_mtx);
+	if ((is = intern_find(str, len, hash)) != NULL) {
+		is->is_refs++;
+		mtx_unlock(&intern_mtx);
+
+		return (is->is_str);
+	}
+	mtx_unlock(&intern_mtx);
+
+	new = malloc(sizeof(struct secadm_istr) + len + 1, M_SECADM,
+	    M_WAITOK);
+	new->is_hash = hash;
+	new->is_refs = 1;
+	new->is_len = len;
+	memcpy(new->is_str, str, len);
+	new->is_str[len] = '\0';
+
+	mtx_lock(&intern_mtx);
+	if (intern_count > intern_mask) {
+		intern_grow();
+	}
+
+	if ((is = intern_find(str, len, hash)) != NULL) {
+		is->is_refs++;
+		mtx_unlock(&intern_mtx);
+		free(new, M_SECADM);
+
+		return (is->is_str);
+	}
+
+	LIST_INSERT_HEAD(&(intern_buckets[hash & intern_mask]), new,
+	    is_entries);
+	intern_count++;
+	mtx_unlock(&intern_mtx);
+
+	return (new->is_str);
+}
+
+void
+secadm_intern_release(u_char *str)
+{
+	struct secadm_istr *is;
+
+	if (str == NULL) {
+		return;
+	}
+
+	is = __containerof(str, struct secadm_istr, is_str);
+
+	mtx_lock(&intern_mtx);
+	if (--is->is_refs > 0) {
+		mtx_unlock(&intern_mtx);
+		return;
+	}
+
+	LIST_REMOVE(is, is_entries);
+	intern_count--;
+	mtx_unlock(&intern_mtx);
+
+	free(is, M_SECADM);
+}
@@ -27,6 +27,7 @@
 
 #include <sys/param.h>
 
+#include <sys/epoch.h>
 #include <sys/jail.h>
 #include <sys/kernel.h>
 #include <sys/lock.h>
@@ -40,82 +41,94 @@
 #include "secadm.h"
 
 secadm_prisons_t secadm_prisons_list;
+int secadm_slot;
 
 static void
 secadm_destroy(struct mac_policy_conf *mpc)
 {
 	secadm_prison_entry_t *entry;
-	secadm_rule_t *r, *next;
+	int i;
 
-	PL_RLOCK();
-	SLIST_FOREACH(entry, &(secadm_prisons_list.sp_prison), sp_entries) {
-		PE_WLOCK(entry);
-		for (r = RB_MIN(secadm_rules_tree, &(entry->sp_rules));
-		    r != NULL; r = next) {
-			next = RB_NEXT(secadm_rules_tree,
-			    &(entry->sp_rules), r);
-			RB_REMOVE(secadm_rules_tree, &(entry->sp_rules), r);
-
-			kernel_free_rule(r);
-		}
-		PE_WUNLOCK(entry);
-	}
-	PL_RUNLOCK();
+	integriforce_uninit();
 
 	PL_WLOCK();
-	while (!SLIST_EMPTY(&(secadm_prisons_list.sp_prison))) {
-		entry = SLIST_FIRST(&(secadm_prisons_list.sp_prison));
+	for (i = 0; i < SECADM_PRISON_BUCKETS; i++) {
+		while ((entry = secadm_prisons_list.sp_buckets[i]) != NULL) {
+			secadm_prisons_list.sp_buckets[i] = entry->sp_next;
 
-		SLIST_REMOVE_HEAD(&(secadm_prisons_list.sp_prison), sp_entries);
-		free(entry, M_SECADM);
+			PE_WLOCK(entry);
+			kernel_flush_rules(entry);
+			PE_WUNLOCK(entry);
+
+			kernel_free_ruleset(entry->sp_ruleset);
+			PE_DESTROY(entry);
+			free(entry, M_SECADM);
+		}
 	}
 	PL_WUNLOCK();
+	PL_DESTROY();
+
+	integriforce_shared_uninit();
+	secadm_rule_zones_uninit();
+	secadm_intern_uninit();
+	epoch_free(secadm_epoch);
+	secadm_filter_uninit();
 }
 
 static void
 secadm_init(struct mac_policy_conf *mpc)
 {
 	PL_INIT();
-	SLIST_INIT(&(secadm_prisons_list.sp_prison));
+	secadm_hash_init();
+	secadm_intern_init();
+	secadm_rule_zones_init();
+	integriforce_shared_init();
+	integriforce_init();
+	secadm_filter_init();
+	secadm_vnode_label_init();
+
+#if __FreeBSD_version >= 1300000
+	secadm_epoch = epoch_alloc("secadm", EPOCH_PREEMPT);
+#else
+	secadm_epoch = epoch_alloc(EPOCH_PREEMPT);
+#endif
 }
 
 static void
 secadm_prison_destroy(struct prison *prison)
 {
 	secadm_prison_entry_t *entry;
-	secadm_rule_t *r, *next;
 
-	PL_RLOCK();
-	SLIST_FOREACH(entry, &(secadm_prisons_list.sp_prison), sp_entries) {
-		if (entry->sp_id == prison->pr_id) {
-			PE_WLOCK(entry);
-			for (r = RB_MIN(secadm_rules_tree, &(entry->sp_rules));
-			    r != NULL; r = next) {
-				next = RB_NEXT(secadm_rules_tree,
-				    &(entry->sp_rules), r);
-				RB_REMOVE(secadm_rules_tree,
-				    &(entry->sp_rules), r);
-
-				kernel_free_rule(r);
-			}
-			PE_WUNLOCK(entry);
-
-			break;
-		}
+	if ((entry = lookup_prison_list_entry(prison->pr_id)) != NULL) {
+		PE_WLOCK(entry);
+		kernel_flush_rules(entry);
+		PE_WUNLOCK(entry);
 	}
-	PL_RUNLOCK();
 }
 
 static struct mac_policy_ops secadm_ops = {
 	.mpo_destroy		= secadm_destroy,
 	.mpo_init		= secadm_init,
 
+	.mpo_vnode_init_label	= secadm_vnode_init_label,
+	.mpo_vnode_destroy_label = secadm_vnode_destroy_label,
+	.mpo_vnode_associate_singlelabel = secadm_vnode_associate_singlelabel,
+	.mpo_vnode_associate_extattr = secadm_vnode_associate_extattr,
+
 	.mpo_vnode_check_exec	= secadm_vnode_check_exec,
 	.mpo_vnode_check_open	= secadm_vnode_check_open,
 	.mpo_vnode_check_unlink	= secadm_vnode_check_unlink,
+	.mpo_vnode_check_write	= secadm_vnode_check_write,
+	.mpo_vnode_check_mmap	= secadm_vnode_check_mmap,
 
 	.mpo_prison_destroy	= secadm_prison_destroy
 };
 
-MAC_POLICY_SET(&secadm_ops, secadm, "HardenedBSD SECADM Module",
-	       MPC_LOADTIME_FLAG_UNLOADOK, NULL);
+/*
+ * Vnodes carry our labels, and the framework stops calling destroy_label
+ * once the policy is gone, so the labels of vnodes still around at that
+ * point would be leaked with the zone they came from.  Once loaded, the
+ * module stays.
+ */
+MAC_POLICY_SET(&secadm_ops, secadm, "HardenedBSD SECADM Module", 0,
+	       &secadm_slot);
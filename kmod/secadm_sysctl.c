@@ -27,6 +27,7 @@
 
 #include <sys/param.h>
 
+#include <sys/epoch.h>
 #include <sys/imgact.h>
 #include <sys/jail.h>
 #include <sys/kernel.h>
@@ -37,7 +38,6 @@
 #include <sys/sx.h>
 #include <sys/sysctl.h>
 #include <sys/systm.h>
-#include <sys/tree.h>
 #include <sys/ucred.h>
 #include <sys/vnode.h>
 
@@ -49,8 +49,9 @@ secadm_sysctl_handler(SYSCTL_HANDLER_ARGS)
 	secadm_prison_entry_t *entry;
 	secadm_command_t cmd;
 	secadm_reply_t reply;
-	secadm_rule_t *rule;
-	int err, i, rn;
+	secadm_preverify_status_t status;
+	secadm_rule_t r, *rule;
+	int err, i;
 	uint32_t flags;
 
 	if (!(req->newptr) || (req->newlen != sizeof(secadm_command_t))) {
@@ -175,30 +176,20 @@ secadm_sysctl_handler(SYSCTL_HANDLER_ARGS)
 		break;
 
 	case secadm_cmd_get_rule:
-		rule = kernel_get_rule(req->td, (secadm_rule_t *) cmd.sc_data);
-
-		if (rule == NULL) {
-			rn = ((secadm_rule_t *) cmd.sc_data)->sr_id + 1;
-
-			entry = get_prison_list_entry(
-			    req->td->td_ucred->cr_prison->pr_id);
-
-			if (rn >= entry->sp_last_id) {
-				break;
-			}
+		/* Deleted IDs leave gaps; hand back the next rule up. */
+		if ((err = copyin(cmd.sc_data, &r, sizeof(secadm_rule_t)))) {
+			reply.sr_code = secadm_reply_fail;
+			break;
+		}
 
-			for (i = rn; i < entry->sp_last_id; i++) {
-				((secadm_rule_t *) cmd.sc_data)->sr_id = i;
-				rule = kernel_get_rule(req->td,
-				    (secadm_rule_t *) cmd.sc_data);
+		entry = get_prison_list_entry(
+		    req->td->td_ucred->cr_prison->pr_id);
 
-				if (rule != NULL) {
-					break;
-				}
-			}
-		}
+		PE_RLOCK(entry);
+		rule = kernel_get_rule(entry, r.sr_id, 1);
 
 		if (rule == NULL) {
+			PE_RUNLOCK(entry);
 			reply.sr_code = secadm_reply_fail;
 			break;
 		}
@@ -209,13 +200,24 @@ secadm_sysctl_handler(SYSCTL_HANDLER_ARGS)
 		} else {
 			reply.sr_code = secadm_reply_success;
 		}
+		PE_RUNLOCK(entry);
 
 		break;
 
 	case secadm_cmd_get_rule_data:
-		rule = kernel_get_rule(req->td, (secadm_rule_t *) cmd.sc_data);
+		if ((err = copyin(cmd.sc_data, &r, sizeof(secadm_rule_t)))) {
+			reply.sr_code = secadm_reply_fail;
+			break;
+		}
+
+		entry = get_prison_list_entry(
+		    req->td->td_ucred->cr_prison->pr_id);
+
+		PE_RLOCK(entry);
+		rule = kernel_get_rule(entry, r.sr_id, 0);
 
 		if (rule == NULL) {
+			PE_RUNLOCK(entry);
 			printf("rule_data: rule is NULL\n");
 			reply.sr_code = secadm_reply_fail;
 			break;
@@ -247,13 +249,24 @@ secadm_sysctl_handler(SYSCTL_HANDLER_ARGS)
 		case secadm_extended_rule:
 			reply.sr_code = secadm_reply_fail;
 		}
+		PE_RUNLOCK(entry);
 
 		break;
 
 	case secadm_cmd_get_rule_path:
-		rule = kernel_get_rule(req->td, (secadm_rule_t *) cmd.sc_data);
+		if ((err = copyin(cmd.sc_data, &r, sizeof(secadm_rule_t)))) {
+			reply.sr_code = secadm_reply_fail;
+			break;
+		}
+
+		entry = get_prison_list_entry(
+		    req->td->td_ucred->cr_prison->pr_id);
+
+		PE_RLOCK(entry);
+		rule = kernel_get_rule(entry, r.sr_id, 0);
 
 		if (rule == NULL) {
+			PE_RUNLOCK(entry);
 			reply.sr_code = secadm_reply_fail;
 			break;
 		}
@@ -284,18 +297,30 @@ secadm_sysctl_handler(SYSCTL_HANDLER_ARGS)
 		case secadm_extended_rule:
 			reply.sr_code = secadm_reply_fail;
 		}
+		PE_RUNLOCK(entry);
 
 		break;
 
 	case secadm_cmd_get_rule_hash:
-		rule = kernel_get_rule(req->td, (secadm_rule_t *) cmd.sc_data);
+		if ((err = copyin(cmd.sc_data, &r, sizeof(secadm_rule_t)))) {
+			reply.sr_code = secadm_reply_fail;
+			break;
+		}
+
+		entry = get_prison_list_entry(
+		    req->td->td_ucred->cr_prison->pr_id);
+
+		PE_RLOCK(entry);
+		rule = kernel_get_rule(entry, r.sr_id, 0);
 
 		if (rule == NULL) {
+			PE_RUNLOCK(entry);
 			reply.sr_code = secadm_reply_fail;
 			break;
 		}
 
 		if (rule->sr_type != secadm_integriforce_rule) {
+			PE_RUNLOCK(entry);
 			reply.sr_code = secadm_reply_fail;
 			break;
 		}
@@ -319,8 +344,19 @@ secadm_sysctl_handler(SYSCTL_HANDLER_ARGS)
 				reply.sr_code = secadm_reply_success;
 			}
 
+			break;
+
+		case secadm_hash_blake3:
+			if ((err = copyout(rule->sr_integriforce_data->si_hash,
+			    reply.sr_data, SECADM_BLAKE3_DIGEST_LEN))) {
+				reply.sr_code = secadm_reply_fail;
+			} else {
+				reply.sr_code = secadm_reply_success;
+			}
+
 			break;
 		}
+		PE_RUNLOCK(entry);
 
 		break;
 
@@ -329,8 +365,8 @@ secadm_sysctl_handler(SYSCTL_HANDLER_ARGS)
 		    req->td->td_ucred->cr_prison->pr_id);
 
 		PE_RLOCK(entry);
-		if ((err = copyout(&(entry->sp_num_rules), reply.sr_data,
-		    sizeof(size_t)))) {
+		if ((err = copyout(&(entry->sp_ruleset->ss_num_rules),
+		    reply.sr_data, sizeof(size_t)))) {
 			reply.sr_code = secadm_reply_fail;
 		} else {
 			reply.sr_code = secadm_reply_success;
@@ -343,11 +379,13 @@ secadm_sysctl_handler(SYSCTL_HANDLER_ARGS)
 		entry = get_prison_list_entry(
 		    req->td->td_ucred->cr_prison->pr_id);
 
-		PE_RLOCK(entry);
+		PE_WLOCK(entry);
 		/* Reusing i to get the flag */
 		err = copyin(cmd.sc_data, &i, sizeof(int));
 		if (err == 0) {
-			if (i) {
+			flags = entry->sp_integriforce_flags;
+
+			if (i & SECADM_INTEGRIFORCE_FLAGS_WHITELIST) {
 				entry->sp_integriforce_flags |=
 				    SECADM_INTEGRIFORCE_FLAGS_WHITELIST;
 			} else {
@@ -355,11 +393,27 @@ secadm_sysctl_handler(SYSCTL_HANDLER_ARGS)
 				    ~(SECADM_INTEGRIFORCE_FLAGS_WHITELIST);
 			}
 
+			if (i & SECADM_INTEGRIFORCE_FLAGS_PREVERIFY) {
+				entry->sp_integriforce_flags |=
+				    SECADM_INTEGRIFORCE_FLAGS_PREVERIFY;
+			} else {
+				entry->sp_integriforce_flags &=
+				    ~(SECADM_INTEGRIFORCE_FLAGS_PREVERIFY);
+			}
+
+			kernel_update_features(entry);
+
+			/* Start on the loaded ruleset, or stop. */
+			if ((flags ^ entry->sp_integriforce_flags) &
+			    SECADM_INTEGRIFORCE_FLAGS_PREVERIFY) {
+				integriforce_preverify(entry);
+			}
+
 			reply.sr_code = secadm_reply_success;
 		} else {
 			reply.sr_code = secadm_reply_fail;
 		}
-		PE_RUNLOCK(entry);
+		PE_WUNLOCK(entry);
 
 		break;
 
@@ -367,7 +421,7 @@ secadm_sysctl_handler(SYSCTL_HANDLER_ARGS)
 		entry = get_prison_list_entry(
 		    req->td->td_ucred->cr_prison->pr_id);
 
-		PE_RLOCK(entry);
+		PE_WLOCK(entry);
 		/* Reusing i to get the flag */
 		err = copyin(cmd.sc_data, &i, sizeof(int));
 		if (err == 0) {
@@ -387,12 +441,13 @@ secadm_sysctl_handler(SYSCTL_HANDLER_ARGS)
 			}
 
 			entry->sp_tpe_flags = flags;
+			kernel_update_features(entry);
 
 			reply.sr_code = secadm_reply_success;
 		} else {
 			reply.sr_code = secadm_reply_fail;
 		}
-		PE_RUNLOCK(entry);
+		PE_WUNLOCK(entry);
 
 		break;
 
@@ -400,7 +455,7 @@ secadm_sysctl_handler(SYSCTL_HANDLER_ARGS)
 		entry = get_prison_list_entry(
 		    req->td->td_ucred->cr_prison->pr_id);
 
-		PE_RLOCK(entry);
+		PE_WLOCK(entry);
 		/* Reusing i to get the flag */
 		err = copyin(cmd.sc_data, &i, sizeof(int));
 		if (err == 0) {
@@ -409,7 +464,7 @@ secadm_sysctl_handler(SYSCTL_HANDLER_ARGS)
 		} else {
 			reply.sr_code = secadm_reply_fail;
 		}
-		PE_RUNLOCK(entry);
+		PE_WUNLOCK(entry);
 
 		break;
 
@@ -449,6 +504,23 @@ secadm_sysctl_handler(SYSCTL_HANDLER_ARGS)
 
 		break;
 
+	case secadm_cmd_get_preverify_status:
+		entry = get_prison_list_entry(
+		    req->td->td_ucred->cr_prison->pr_id);
+
+		PE_RLOCK(entry);
+		integriforce_preverify_status(entry, &status);
+		PE_RUNLOCK(entry);
+
+		if (copyout(&status, reply.sr_data,
+		    sizeof(secadm_preverify_status_t))) {
+			reply.sr_code = secadm_reply_fail;
+		} else {
+			reply.sr_code = secadm_reply_success;
+		}
+
+		break;
+
 	default:
 		printf("secadm_sysctl: unknown command!\n");
 
@@ -0,0 +1,399 @@
+/*-
+ * Copyright (c) 2026 The HardenedBSD Project
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Key index.
+ *
+ * Maps a secadm_key_t to the object it is embedded in: staged rules, or
+ * the per-file records of a published ruleset.  The table stores a
+ * pointer to the key, callers get back to the object from there.
+ *
+ * Open addressing over groups of SECADM_TABLE_GROUP slots.  Every slot
+ * has a control byte that is either EMPTY, DELETED or the low seven bits
+ * of the key's hash.  A probe loads a whole group of control bytes as
+ * one 64-bit word and compares all eight at once, so a lookup normally
+ * touches one control word and one slot.
+ *
+ * Growing never rehashes the whole table in one go.  A new generation is
+ * allocated and each subsequent insert or remove migrates a few groups
+ * of the old generation into it.  Lookups check both generations and
+ * never migrate, so they never write to the table: the hooks read a
+ * published ruleset's table inside an epoch section, without a lock,
+ * and are never charged for a resize.
+ */
+
+#include <sys/param.h>
+
+#include <sys/endian.h>
+#include <sys/epoch.h>
+#include <sys/kernel.h>
+#include <sys/libkern.h>
+#include <sys/lock.h>
+#include <sys/malloc.h>
+#include <sys/mount.h>
+#include <sys/sx.h>
+#include <sys/systm.h>
+
+#include "secadm.h"
+
+#define	CTRL_EMPTY		0x80
+#define	CTRL_DELETED		0xfe
+
+#define	GROUP_LSB		0x0101010101010101ULL
+#define	GROUP_MSB		0x8080808080808080ULL
+
+#define	TABLE_H1(h)		((h) >> 7)
+#define	TABLE_H2(h)		((uint8_t)((h) & 0x7f))
+
+/* Number of old groups moved into the new generation per update. */
+#define	TABLE_MIGRATE_STEP	4
+
+static inline uint64_t
+group_load(const uint8_t *ctrl)
+{
+
+	return (le64dec(ctrl));
+}
+
+/*
+ * Bytes equal to h2.  May report a false positive next to a true match;
+ * callers always compare the full key.
+ */
+static inline uint64_t
+group_match(uint64_t grp, uint8_t h2)
+{
+	uint64_t x;
+
+	x = grp ^ (GROUP_LSB * h2);
+
+	return ((x - GROUP_LSB) & ~x & GROUP_MSB);
+}
+
+static inline uint64_t
+group_match_empty(uint64_t grp)
+{
+
+	return (grp & ~(grp << 6) & GROUP_MSB);
+}
+
+static inline uint64_t
+group_match_free(uint64_t grp)
+{
+
+	return (grp & GROUP_MSB);
+}
+
+static inline size_t
+group_slot(size_t pos, uint64_t mask)
+{
+
+	return (pos * SECADM_TABLE_GROUP + ((ffsll(mask) - 1) >> 3));
+}
+
+static inline int
+table_match(secadm_key_t *a, secadm_key_t *b)
+{
+
+	return (a->sk_fileid == b->sk_fileid &&
+	    a->sk_type == b->sk_type &&
+	    !memcmp(&(a->sk_fsid), &(b->sk_fsid), sizeof(fsid_t)));
+}
+
+static void
+table_gen_alloc(struct secadm_table_gen *gen, size_t ngroups)
+{
+	size_t nslots;
+
+	nslots = ngroups * SECADM_TABLE_GROUP;
+
+	gen->stg_ctrl = malloc(nslots, M_SECADM, M_WAITOK);
+	memset(gen->stg_ctrl, CTRL_EMPTY, nslots);
+	gen->stg_slots = mallocarray(nslots, sizeof(secadm_key_t *),
+	    M_SECADM, M_WAITOK | M_ZERO);
+	gen->stg_ngroups = ngroups;
+	gen->stg_used = 0;
+}
+
+static void
+table_gen_free(struct secadm_table_gen *gen)
+{
+
+	if (gen->stg_ngroups) {
+		free(gen->stg_ctrl, M_SECADM);
+		free(gen->stg_slots, M_SECADM);
+	}
+
+	memset(gen, 0x00, sizeof(struct secadm_table_gen));
+}
+
+static secadm_key_t *
+table_gen_lookup(struct secadm_table_gen *gen, secadm_key_t *key,
+    uint64_t hash)
+{
+	size_t mask, pos, probe, slot;
+	secadm_key_t *k;
+	uint64_t grp, m;
+	uint8_t h2;
+
+	if (gen->stg_ngroups == 0)
+		return (NULL);
+
+	mask = gen->stg_ngroups - 1;
+	pos = TABLE_H1(hash) & mask;
+	h2 = TABLE_H2(hash);
+
+	for (probe = 0; probe <= mask; probe++) {
+		grp = group_load(&(gen->stg_ctrl[pos * SECADM_TABLE_GROUP]));
+
+		for (m = group_match(grp, h2); m != 0; m &= m - 1) {
+			slot = group_slot(pos, m);
+			k = gen->stg_slots[slot];
+
+			if (k != NULL && table_match(k, key))
+				return (k);
+		}
+
+		if (group_match_empty(grp))
+			return (NULL);
+
+		pos = (pos + probe + 1) & mask;
+	}
+
+	return (NULL);
+}
+
+static void
+table_gen_insert(struct secadm_table_gen *gen, secadm_key_t *key,
+    uint64_t hash)
+{
+	size_t mask, pos, probe, slot;
+	uint64_t grp, m;
+
+	mask = gen->stg_ngroups - 1;
+	pos = TABLE_H1(hash) & mask;
+
+	for (probe = 0; probe <= mask; probe++) {
+		grp = group_load(&(gen->stg_ctrl[pos * SECADM_TABLE_GROUP]));
+
+		if ((m = group_match_free(grp)) != 0) {
+			slot = group_slot(pos, m);
+
+			if (gen->stg_ctrl[slot] == CTRL_EMPTY)
+				gen->stg_used++;
+
+			gen->stg_ctrl[slot] = TABLE_H2(hash);
+			gen->stg_slots[slot] = key;
+
+			return;
+		}
+
+		pos = (pos + probe + 1) & mask;
+	}
+
+	panic("secadm_table: no free slot in a table below its load limit");
+}
+
+static int
+table_gen_remove(struct secadm_table_gen *gen, secadm_key_t *key,
+    uint64_t hash)
+{
+	size_t mask, pos, probe, slot;
+	uint64_t grp, m;
+	uint8_t h2;
+
+	if (gen->stg_ngroups == 0)
+		return (0);
+
+	mask = gen->stg_ngroups - 1;
+	pos = TABLE_H1(hash) & mask;
+	h2 = TABLE_H2(hash);
+
+	for (probe = 0; probe <= mask; probe++) {
+		grp = group_load(&(gen->stg_ctrl[pos * SECADM_TABLE_GROUP]));
+
+		for (m = group_match(grp, h2); m != 0; m &= m - 1) {
+			slot = group_slot(pos, m);
+
+			if (gen->stg_slots[slot] == key) {
+				gen->stg_ctrl[slot] = CTRL_DELETED;
+				gen->stg_slots[slot] = NULL;
+
+				return (1);
+			}
+		}
+
+		if (group_match_empty(grp))
+			return (0);
+
+		pos = (pos + probe + 1) & mask;
+	}
+
+	return (0);
+}
+
+/*
+ * Move up to ngroups groups of the old generation into the current one.
+ * Migrated slots are left DELETED so that probe chains running through
+ * them for not yet migrated keys stay intact.  Only the low bits of a
+ * key's hash are kept, so it is hashed again on the way over.
+ */
+static void
+table_migrate(secadm_table_t *table, size_t ngroups)
+{
+	struct secadm_table_gen *old;
+	size_t i, slot, end;
+
+	old = &(table->st_old);
+	if (old->stg_ngroups == 0)
+		return;
+
+	end = MIN(table->st_migrate + ngroups, old->stg_ngroups);
+
+	for (; table->st_migrate < end; table->st_migrate++) {
+		slot = table->st_migrate * SECADM_TABLE_GROUP;
+
+		for (i = slot; i < slot + SECADM_TABLE_GROUP; i++) {
+			if (old->stg_ctrl[i] & CTRL_EMPTY)
+				continue;
+
+			table_gen_insert(&(table->st_cur), old->stg_slots[i],
+			    secadm_hash(old->stg_slots[i]));
+
+			old->stg_ctrl[i] = CTRL_DELETED;
+			old->stg_slots[i] = NULL;
+		}
+	}
+
+	if (table->st_migrate == old->stg_ngroups) {
+		table_gen_free(old);
+		table->st_migrate = 0;
+	}
+}
+
+static size_t
+table_groups_for(size_t count)
+{
+	size_t ngroups;
+
+	/* Twice the live count, at 7/8 maximum load. */
+	count = MAX(count * 2, SECADM_TABLE_GROUP);
+	ngroups = howmany(howmany(count * 8, 7), SECADM_TABLE_GROUP);
+
+	return ((size_t)1 << flsl(ngroups - 1));
+}
+
+static void
+table_grow(secadm_table_t *table)
+{
+
+	/*
+	 * Migration empties the old generation long before the new one
+	 * fills up, so this drain is normally a no-op.  It keeps the table
+	 * at two generations at most.
+	 */
+	if (table->st_old.stg_ngroups)
+		table_migrate(table, table->st_old.stg_ngroups);
+
+	table->st_old = table->st_cur;
+	table->st_migrate = 0;
+	table_gen_alloc(&(table->st_cur), table_groups_for(table->st_count));
+
+	if (table->st_old.stg_ngroups == 0)
+		return;
+
+	table_migrate(table, TABLE_MIGRATE_STEP);
+}
+
+void
+secadm_table_init(secadm_table_t *table)
+{
+
+	memset(table, 0x00, sizeof(secadm_table_t));
+}
+
+/*
+ * Size an empty table for count keys up front, so filling it never
+ * goes through intermediate generations.
+ */
+void
+secadm_table_reserve(secadm_table_t *table, size_t count)
+{
+
+	if (table->st_cur.stg_ngroups == 0 && table->st_old.stg_ngroups == 0)
+		table_gen_alloc(&(table->st_cur), table_groups_for(count));
+}
+
+void
+secadm_table_destroy(secadm_table_t *table)
+{
+
+	table_gen_free(&(table->st_cur));
+	table_gen_free(&(table->st_old));
+	secadm_table_init(table);
+}
+
+secadm_key_t *
+secadm_table_lookup(secadm_table_t *table, secadm_key_t *key, uint64_t hash)
+{
+	secadm_key_t *k;
+
+	if ((k = table_gen_lookup(&(table->st_cur), key, hash)) != NULL)
+		return (k);
+
+	return (table_gen_lookup(&(table->st_old), key, hash));
+}
+
+/*
+ * Keys are stored by reference and must stay put, unchanged, until they
+ * are removed.  hash is secadm_hash() of the key.
+ */
+void
+secadm_table_insert(secadm_table_t *table, secadm_key_t *key, uint64_t hash)
+{
+	struct secadm_table_gen *cur;
+
+	cur = &(table->st_cur);
+
+	if ((cur->stg_used + 1) * 8 >
+	    cur->stg_ngroups * SECADM_TABLE_GROUP * 7)
+		table_grow(table);
+	else
+		table_migrate(table, TABLE_MIGRATE_STEP);
+
+	table_gen_insert(cur, key, hash);
+	table->st_count++;
+}
+
+void
+secadm_table_remove(secadm_table_t *table, secadm_key_t *key, uint64_t hash)
+{
+
+	if (table_gen_remove(&(table->st_cur), key, hash) ||
+	    table_gen_remove(&(table->st_old), key, hash))
+		table->st_count--;
+
+	table_migrate(table, TABLE_MIGRATE_STEP);
+}
@@ -27,19 +27,21 @@
 
 #include <sys/param.h>
 
+#include <sys/epoch.h>
 #include <sys/imgact.h>
 #include <sys/jail.h>
 #include <sys/kernel.h>
 #include <sys/libkern.h>
 #include <sys/lock.h>
+#include <sys/mman.h>
 #include <sys/module.h>
 #include <sys/mount.h>
 #include <sys/pax.h>
 #include <sys/sx.h>
-#include <sys/tree.h>
 #include <sys/vnode.h>
 
 #include <security/mac/mac_policy.h>
+#include <vm/uma.h>
 
 #include "secadm.h"
 
@@ -63,162 +65,428 @@ secadm_pax_elf(struct image_params *imgp, pax_flag_t flags)
 #endif
 }
 
+/*
+ * Each vnode label caches what the exec hook last resolved for the file:
+ * its Integriforce rule, if any, and the PaX flags to apply.  An entry
+ * is only valid while its generation is the prison's current one, and
+ * the rule pointer is only dereferenced inside the epoch section the
+ * generation was read in.  Concurrent execs of the same file fill the
+ * label under a sequence count: a writer that loses the race skips the
+ * update and readers that see it in flight fall back to a full lookup.
+ *
+ * Once Integriforce has hashed a file, the label also counts writes to
+ * it, so that a verification result stamped with the count goes stale
+ * on the next write rather than on the next attribute update.
+ */
+struct secadm_vnode_label {
+	volatile u_int		 sl_seq;
+	uint64_t		 sl_gen;
+	secadm_rule_t		*sl_integriforce;
+	pax_flag_t		 sl_pax_flags;
+	volatile u_int		 sl_watched;
+	volatile u_int		 sl_writes;
+};
+
+#define	SLOT(l)		((struct secadm_vnode_label *)mac_label_get((l), \
+			    secadm_slot))
+#define	SLOT_SET(l, v)	mac_label_set((l), secadm_slot, (intptr_t)(v))
+
+static uma_zone_t secadm_label_zone;
+
+void
+secadm_vnode_label_init(void)
+{
+
+	secadm_label_zone = uma_zcreate("secadm vnode label",
+	    sizeof(struct secadm_vnode_label), NULL, NULL, NULL, NULL,
+	    UMA_ALIGN_PTR, 0);
+}
+
+void
+secadm_vnode_init_label(struct label *label)
+{
+
+	SLOT_SET(label, uma_zalloc(secadm_label_zone, M_WAITOK | M_ZERO));
+}
+
+void
+secadm_vnode_destroy_label(struct label *label)
+{
+	struct secadm_vnode_label *sl;
+
+	if ((sl = SLOT(label)) != NULL) {
+		uma_zfree(secadm_label_zone, sl);
+		SLOT_SET(label, NULL);
+	}
+}
+
+static void
+secadm_label_reset(struct label *label)
+{
+	struct secadm_vnode_label *sl;
+
+	if ((sl = SLOT(label)) != NULL) {
+		sl->sl_gen = 0;
+	}
+}
+
+void
+secadm_vnode_associate_singlelabel(struct mount *mp, struct label *mplabel,
+    struct vnode *vp, struct label *vplabel)
+{
+
+	secadm_label_reset(vplabel);
+}
+
 int
-secadm_vnode_check_exec(struct ucred *ucred, struct vnode *vp,
-    struct label *vplabel, struct image_params *imgp,
-    struct label *execlabel)
+secadm_vnode_associate_extattr(struct mount *mp, struct label *mplabel,
+    struct vnode *vp, struct label *vplabel)
 {
-	secadm_prison_entry_t *entry;
-	secadm_rule_t r, *rule;
-	int err, flags = 0;
+
+	secadm_label_reset(vplabel);
+	return (0);
+}
+
+/*
+ * Start counting writes to vp and return the count so far.  Vnodes
+ * without a label always report 0; for them only the file's attributes
+ * tell whether it changed.
+ */
+u_int
+secadm_vnode_watch_writes(struct vnode *vp)
+{
+	struct secadm_vnode_label *sl;
+
+	if (vp->v_label == NULL || (sl = SLOT(vp->v_label)) == NULL) {
+		return (0);
+	}
+
+	if (atomic_load_int(&(sl->sl_watched)) == 0) {
+		atomic_store_rel_int(&(sl->sl_watched), 1);
+	}
+
+	return (atomic_load_acq_int(&(sl->sl_writes)));
+}
+
+/*
+ * Writes are counted on the vnode at the bottom of any nullfs stack,
+ * which is where Integriforce watches for them: that way a write
+ * through any vnode stacked on the file, from any jail, is seen.  The
+ * hooks calling this hold vp locked.
+ */
+static void
+secadm_vnode_written(struct vnode *vp)
+{
+	struct secadm_vnode_label *sl;
+
+	vp = integriforce_lower_vnode(vp);
+
+	if (vp->v_label == NULL || (sl = SLOT(vp->v_label)) == NULL) {
+		return;
+	}
+
+	if (atomic_load_acq_int(&(sl->sl_watched))) {
+		atomic_add_rel_int(&(sl->sl_writes), 1);
+	}
+}
+
+int
+secadm_vnode_check_write(struct ucred *active_cred, struct ucred *file_cred,
+    struct vnode *vp, struct label *vplabel)
+{
+
+	secadm_vnode_written(vp);
+	return (0);
+}
+
+/*
+ * Writes through a shared mapping never reach check_write.  Count the
+ * mapping itself instead, whatever protection it starts out with: one
+ * made read-only from a descriptor open for writing can be switched to
+ * writable by mprotect(2), which policies do not get to see.  Such a
+ * mapping holds the vnode's write count up for as long as it exists,
+ * and stamps are neither recorded nor believed while that is nonzero,
+ * so by the time one is consulted again any writes through the mapping
+ * have happened after the count moved.
+ */
+int
+secadm_vnode_check_mmap(struct ucred *ucred, struct vnode *vp,
+    struct label *vplabel, int prot, int flags)
+{
+
+	if (flags & MAP_SHARED) {
+		secadm_vnode_written(vp);
+	}
+
+	return (0);
+}
+
+static int
+secadm_label_get(struct label *label, uint64_t gen, secadm_rule_t **rule,
+    pax_flag_t *flags)
+{
+	struct secadm_vnode_label *sl;
+	u_int seq;
+
+	/* Vnodes created before the module was loaded have no label. */
+	if (label == NULL || (sl = SLOT(label)) == NULL) {
+		return (0);
+	}
+
+	seq = atomic_load_acq_int(&(sl->sl_seq));
+
+	if ((seq & 1) || sl->sl_gen != gen) {
+		return (0);
+	}
+
+	*rule = sl->sl_integriforce;
+	*flags = sl->sl_pax_flags;
+
+	atomic_thread_fence_acq();
+
+	return (atomic_load_int(&(sl->sl_seq)) == seq);
+}
+
+static void
+secadm_label_set(struct label *label, uint64_t gen, secadm_rule_t *rule,
+    pax_flag_t flags)
+{
+	struct secadm_vnode_label *sl;
+	u_int seq;
+
+	if (label == NULL || (sl = SLOT(label)) == NULL) {
+		return;
+	}
+
+	seq = atomic_load_int(&(sl->sl_seq));
+
+	if ((seq & 1) || !atomic_cmpset_acq_int(&(sl->sl_seq), seq, seq + 1)) {
+		return;
+	}
+
+	sl->sl_gen = gen;
+	sl->sl_integriforce = rule;
+	sl->sl_pax_flags = flags;
+
+	atomic_store_rel_int(&(sl->sl_seq), seq + 2);
+}
+
+/*
+ * Full lookup of what applies to a file on exec.  Called inside the
+ * epoch section that rs was read in.
+ */
+static void
+secadm_vnode_resolve(secadm_ruleset_t *rs, struct vnode *vp,
+    struct vattr *vap, secadm_rule_t **integriforce, pax_flag_t *flags)
+{
+	secadm_file_t *f;
 	secadm_key_t key;
-	struct vattr vap;
 
-	if ((err = VOP_GETATTR(imgp->vp, &vap, ucred))) {
-		return (err);
+	*integriforce = NULL;
+	*flags = 0;
+
+	memset(&key, 0x00, sizeof(secadm_key_t));
+	key.sk_fsid = vp->v_mount->mnt_stat.f_fsid;
+	key.sk_fileid = vap->va_fileid;
+
+	if (!secadm_filter_query(&(rs->ss_filter), &key)) {
+		return;
 	}
 
-	key.sk_jid = ucred->cr_prison->pr_id;
-	key.sk_fileid = vap.va_fileid;
-	strncpy(key.sk_mntonname,
-	    imgp->vp->v_mount->mnt_stat.f_mntonname, MNAMELEN);
+	if ((f = kernel_lookup_file(rs, &key)) == NULL) {
+		secadm_filter_false_positive();
+		return;
+	}
+
+	*integriforce = f->sfi_integriforce;
+
+	if (f->sfi_pax != NULL && SECADM_RULE_ACTIVE(f->sfi_pax)) {
+		*flags = f->sfi_pax->sr_pax_flags;
+	}
+}
 
-	entry = get_prison_list_entry(ucred->cr_prison->pr_id);
+/*
+ * The body of every exec handler.  The feature arguments are constants
+ * at each call site, so each handler below is compiled down to just the
+ * checks its prison has configured.
+ */
+static __always_inline int
+secadm_exec(secadm_prison_entry_t *entry, struct ucred *ucred,
+    struct vnode *vp, struct label *vplabel, struct image_params *imgp,
+    const int tpe, const int integriforce, const int whitelist, const int pax)
+{
+	struct epoch_tracker et;
+	secadm_ruleset_t *rs;
+	secadm_rule_t *rule;
+	struct vattr vap;
+	pax_flag_t flags;
+	int err, have_vap;
+	uint64_t gen;
 
-	if ((err = tpe_check(imgp, entry))) {
+	if (tpe && (err = tpe_check(imgp, entry))) {
 		return (err);
 	}
 
-	PE_RLOCK(entry);
-	if (entry->sp_num_integriforce_rules) {
-		key.sk_type = secadm_integriforce_rule;
-		r.sr_key = fnv_32_buf(&key, sizeof(secadm_key_t), FNV1_32_INIT);
-		rule = RB_FIND(secadm_rules_tree, &(entry->sp_rules), &r);
-
-		if (rule != NULL) {
-			if (rule->sr_active == 0) {
-				goto rule_inactive;
-			}
-
-			PE_RUNLOCK(entry);
-			err = do_integriforce_check(rule, &vap, imgp->vp, ucred);
-			PE_RLOCK(entry);
-
-			if (err) {
-				PE_RUNLOCK(entry);
-
-				return (err);
-			}
-		} else if ((entry->sp_integriforce_flags &
-		    SECADM_INTEGRIFORCE_FLAGS_WHITELIST) ==
-		    SECADM_INTEGRIFORCE_FLAGS_WHITELIST) {
-			PE_RUNLOCK(entry);
-			printf("[SECADM] Whitelist Mode: Execution of %s denied.\n",
-			    imgp->args->fname);
-			return (EPERM);
+	if (!integriforce && !pax) {
+		return (0);
+	}
+
+	err = 0;
+	have_vap = 0;
+
+	SECADM_EPOCH_ENTER(et);
+	gen = SECADM_GENERATION(entry);
+	rs = SECADM_RULESET(entry);
+
+	/*
+	 * The label always gets the full answer, whatever this handler
+	 * acts on: the prison may have switched handlers since gen was
+	 * read.
+	 */
+	if (!secadm_label_get(vplabel, gen, &rule, &flags)) {
+		/* VOP_GETATTR may sleep, which an epoch section must not. */
+		SECADM_EPOCH_EXIT(et);
+
+		if ((err = VOP_GETATTR(vp, &vap, ucred))) {
+			return (err);
 		}
+
+		have_vap = 1;
+
+		SECADM_EPOCH_ENTER(et);
+		gen = SECADM_GENERATION(entry);
+		rs = SECADM_RULESET(entry);
+
+		secadm_vnode_resolve(rs, vp, &vap, &rule, &flags);
+		secadm_label_set(vplabel, gen, rule, flags);
 	}
 
-	if (entry->sp_num_pax_rules) {
-		key.sk_type = secadm_pax_rule;
-		r.sr_key = fnv_32_buf(&key, sizeof(secadm_key_t), FNV1_32_INIT);
-		rule = RB_FIND(secadm_rules_tree, &(entry->sp_rules), &r);
-
-		if (rule) {
-			if (rule->sr_active == 0) {
-				goto rule_inactive;
-			}
-
-			if (rule->sr_pax_data->sp_pax_set &
-			    SECADM_PAX_PAGEEXEC_SET) {
-				if (rule->sr_pax_data->sp_pax &
-				    SECADM_PAX_PAGEEXEC) {
-					flags |= PAX_NOTE_PAGEEXEC;
-				} else {
-					flags |= PAX_NOTE_NOPAGEEXEC;
-				}
-			}
-
-			if (rule->sr_pax_data->sp_pax_set &
-			    SECADM_PAX_MPROTECT_SET) {
-				if (rule->sr_pax_data->sp_pax &
-				    SECADM_PAX_MPROTECT) {
-					flags |= PAX_NOTE_MPROTECT;
-				} else {
-					flags |= PAX_NOTE_NOMPROTECT;
-				}
-			}
-
-			if (rule->sr_pax_data->sp_pax_set &
-			    SECADM_PAX_ASLR_SET) {
-				if (rule->sr_pax_data->sp_pax &
-				    SECADM_PAX_ASLR) {
-					flags |= PAX_NOTE_ASLR;
-				} else {
-					flags |= PAX_NOTE_NOASLR;
-				}
-			}
-
-			if (rule->sr_pax_data->sp_pax_set &
-			    SECADM_PAX_SEGVGUARD_SET) {
-				if (rule->sr_pax_data->sp_pax &
-				    SECADM_PAX_SEGVGUARD) {
-					flags |= PAX_NOTE_SEGVGUARD;
-				} else {
-					flags |= PAX_NOTE_NOSEGVGUARD;
-				}
-			}
-
-			if (rule->sr_pax_data->sp_pax_set &
-			    SECADM_PAX_SHLIBRANDOM_SET) {
-				if (rule->sr_pax_data->sp_pax &
-				    SECADM_PAX_SHLIBRANDOM) {
-					flags |= PAX_NOTE_SHLIBRANDOM;
-				} else {
-					flags |= PAX_NOTE_NOSHLIBRANDOM;
-				}
-			}
-
-			if (rule->sr_pax_data->sp_pax_set &
-			    SECADM_PAX_MAP32) {
-				if (rule->sr_pax_data->sp_pax &
-				    SECADM_PAX_MAP32) {
-					flags |=
-					    PAX_NOTE_DISALLOWMAP32BIT;
-				} else {
-					flags |=
-					    PAX_NOTE_NODISALLOWMAP32BIT;
-				}
-			}
-
-#ifdef PAX_NOTE_PREFER_ACL
-			if (rule->sr_pax_data->sp_pax_set &
-			    SECADM_PAX_PREFER_ACL) {
-				if (rule->sr_pax_data->sp_pax &
-				    SECADM_PAX_PREFER_ACL) {
-					flags |= PAX_NOTE_PREFER_ACL;
-				} else {
-					flags &= ~PAX_NOTE_PREFER_ACL;
-				}
-			}
-#endif
+	if (integriforce && rule != NULL) {
+		if (!SECADM_RULE_ACTIVE(rule)) {
+			SECADM_EPOCH_EXIT(et);
+			return (0);
 		}
+
+		/*
+		 * Hashing sleeps too.  Keep the rule alive by reference
+		 * instead of by staying in the section.
+		 */
+		kernel_rule_acquire(rule);
+		SECADM_EPOCH_EXIT(et);
+
+		if (!have_vap) {
+			err = VOP_GETATTR(vp, &vap, ucred);
+		}
+
+		if (err == 0) {
+			err = do_integriforce_check(rule, &vap, vp, ucred);
+		}
+
+		kernel_rule_release(rule);
+
+		if (err) {
+			return (err);
+		}
+	} else if (whitelist && rule == NULL &&
+	    rs->ss_num_integriforce_rules) {
+		SECADM_EPOCH_EXIT(et);
+		printf("[SECADM] Whitelist Mode: Execution of %s denied.\n",
+		    imgp->args->fname);
+		return (EPERM);
+	} else {
+		SECADM_EPOCH_EXIT(et);
 	}
-rule_inactive:
-	PE_RUNLOCK(entry);
 
-	if (err == 0 && flags)
+	if (pax && flags) {
 		err = secadm_pax_elf(imgp, flags);
+	}
 
 	return (err);
 }
 
+#define	SECADM_EXEC_HANDLER_DEFINE(name, tpe, integriforce, whitelist, pax) \
+static int								\
+secadm_exec_##name(secadm_prison_entry_t *entry, struct ucred *ucred,	\
+    struct vnode *vp, struct label *vplabel, struct image_params *imgp)	\
+{									\
+									\
+	return (secadm_exec(entry, ucred, vp, vplabel, imgp,		\
+	    tpe, integriforce, whitelist, pax));			\
+}
+
+SECADM_EXEC_HANDLER_DEFINE(none,		0, 0, 0, 0)
+SECADM_EXEC_HANDLER_DEFINE(tpe,			1, 0, 0, 0)
+SECADM_EXEC_HANDLER_DEFINE(integriforce,	0, 1, 0, 0)
+SECADM_EXEC_HANDLER_DEFINE(whitelist,		0, 1, 1, 0)
+SECADM_EXEC_HANDLER_DEFINE(pax,			0, 0, 0, 1)
+SECADM_EXEC_HANDLER_DEFINE(tpe_integriforce,	1, 1, 0, 0)
+SECADM_EXEC_HANDLER_DEFINE(tpe_whitelist,	1, 1, 1, 0)
+SECADM_EXEC_HANDLER_DEFINE(tpe_pax,		1, 0, 0, 1)
+SECADM_EXEC_HANDLER_DEFINE(integriforce_pax,	0, 1, 0, 1)
+SECADM_EXEC_HANDLER_DEFINE(whitelist_pax,	0, 1, 1, 1)
+SECADM_EXEC_HANDLER_DEFINE(all,			1, 1, 0, 1)
+SECADM_EXEC_HANDLER_DEFINE(all_whitelist,	1, 1, 1, 1)
+
+#define	F_I	SECADM_FEATURE_INTEGRIFORCE
+#define	F_P	SECADM_FEATURE_PAX
+#define	F_T	SECADM_FEATURE_TPE
+#define	F_W	SECADM_FEATURE_WHITELIST
+
+/* WHITELIST is only ever set along with INTEGRIFORCE. */
+static const secadm_exec_handler_t secadm_exec_handlers[] = {
+	[0]			= secadm_exec_none,
+	[F_T]			= secadm_exec_tpe,
+	[F_I]			= secadm_exec_integriforce,
+	[F_I | F_W]		= secadm_exec_whitelist,
+	[F_P]			= secadm_exec_pax,
+	[F_T | F_I]		= secadm_exec_tpe_integriforce,
+	[F_T | F_I | F_W]	= secadm_exec_tpe_whitelist,
+	[F_T | F_P]		= secadm_exec_tpe_pax,
+	[F_I | F_P]		= secadm_exec_integriforce_pax,
+	[F_I | F_P | F_W]	= secadm_exec_whitelist_pax,
+	[F_T | F_I | F_P]	= secadm_exec_all,
+	[F_T | F_I | F_P | F_W]	= secadm_exec_all_whitelist,
+};
+
+#undef F_I
+#undef F_P
+#undef F_T
+#undef F_W
+
+secadm_exec_handler_t
+secadm_vnode_exec_handler(u_int features)
+{
+
+	KASSERT(secadm_exec_handlers[features & SECADM_FEATURE_MASK] != NULL,
+	    ("secadm: no exec handler for features %#x", features));
+
+	return (secadm_exec_handlers[features & SECADM_FEATURE_MASK]);
+}
+
+int
+secadm_vnode_check_exec(struct ucred *ucred, struct vnode *vp,
+    struct label *vplabel, struct image_params *imgp,
+    struct label *execlabel)
+{
+	secadm_prison_entry_t *entry;
+
+	if ((entry = lookup_prison_list_entry(ucred->cr_prison->pr_id)) ==
+	    NULL) {
+		return (0);
+	}
+
+	return (SECADM_EXEC_HANDLER(entry)(entry, ucred, vp, vplabel, imgp));
+}
+
 int
 secadm_vnode_check_open(struct ucred *ucred, struct vnode *vp,
     struct label *vplabel, accmode_t accmode)
 {
 	secadm_prison_entry_t *entry;
-	secadm_rule_t r, *rule;
+	struct epoch_tracker et;
+	secadm_ruleset_t *rs;
+	secadm_rule_t *rule;
+	secadm_file_t *f;
 	secadm_key_t key;
 	struct vattr vap;
 	int err;
@@ -227,39 +495,43 @@ secadm_vnode_check_open(struct ucred *ucred, struct vnode *vp,
 		return (0);
 	}
 
+	if ((entry = lookup_prison_list_entry(ucred->cr_prison->pr_id)) ==
+	    NULL ||
+	    !(SECADM_FEATURES(entry) & SECADM_FEATURE_INTEGRIFORCE)) {
+		return (0);
+	}
+
 	if ((err = VOP_GETATTR(vp, &vap, ucred))) {
 		return (err);
 	}
 
-	key.sk_jid = ucred->cr_prison->pr_id;
+	memset(&key, 0x00, sizeof(secadm_key_t));
+	key.sk_fsid = vp->v_mount->mnt_stat.f_fsid;
 	key.sk_fileid = vap.va_fileid;
-	strncpy(key.sk_mntonname,
-	    vp->v_mount->mnt_stat.f_mntonname, MNAMELEN);
 
-	entry = get_prison_list_entry(ucred->cr_prison->pr_id);
+	SECADM_EPOCH_ENTER(et);
+	rs = SECADM_RULESET(entry);
 
-	PE_RLOCK(entry);
-	if (entry->sp_num_integriforce_rules) {
-		key.sk_type = secadm_integriforce_rule;
-		r.sr_key = fnv_32_buf(&key, sizeof(secadm_key_t), FNV1_32_INIT);
-
-		rule = RB_FIND(secadm_rules_tree, &(entry->sp_rules), &r);
+	if (!secadm_filter_query(&(rs->ss_filter), &key)) {
+		SECADM_EPOCH_EXIT(et);
+		return (0);
+	}
 
-		if (rule) {
-			if (rule->sr_active ||
-			    (entry->sp_integriforce_flags & SECADM_INTEGRIFORCE_FLAGS_WHITELIST)) {
-				printf(
-				    "[SECADM] Prevented modification of (%s): "
-				    "protected by a SECADM rule.\n",
-				    rule->sr_integriforce_data->si_path);
+	if ((f = kernel_lookup_file(rs, &key)) != NULL &&
+	    (rule = f->sfi_integriforce) != NULL) {
+		if (SECADM_RULE_ACTIVE(rule) ||
+		    (entry->sp_integriforce_flags & SECADM_INTEGRIFORCE_FLAGS_WHITELIST)) {
+			printf(
+			    "[SECADM] Prevented modification of (%s): "
+			    "protected by a SECADM rule.\n",
+			    rule->sr_integriforce_data->si_path);
 
-				PE_RUNLOCK(entry);
-				return (EPERM);
-			}
+			SECADM_EPOCH_EXIT(et);
+			return (EPERM);
 		}
 	}
 
-	PE_RUNLOCK(entry);
+	SECADM_EPOCH_EXIT(et);
 	return (0);
 }
 
@@ -269,62 +541,65 @@ secadm_vnode_check_unlink(struct ucred *ucred, struct vnode *dvp,
     struct label *vplabel, struct componentname *cnp)
 {
 	secadm_prison_entry_t *entry;
-	secadm_rule_t r, *rule;
+	struct epoch_tracker et;
+	secadm_ruleset_t *rs;
+	secadm_rule_t *rule;
+	secadm_file_t *f;
 	secadm_key_t key;
 	struct vattr vap;
 	int err;
 
+	if ((entry = lookup_prison_list_entry(ucred->cr_prison->pr_id)) ==
+	    NULL ||
+	    !(SECADM_FEATURES(entry) &
+	    (SECADM_FEATURE_INTEGRIFORCE | SECADM_FEATURE_PAX))) {
+		return (0);
+	}
+
 	if ((err = VOP_GETATTR(vp, &vap, ucred))) {
 		return (err);
 	}
 
-	entry = get_prison_list_entry(ucred->cr_prison->pr_id);
-
-	key.sk_jid = ucred->cr_prison->pr_id;
+	memset(&key, 0x00, sizeof(secadm_key_t));
+	key.sk_fsid = vp->v_mount->mnt_stat.f_fsid;
 	key.sk_fileid = vap.va_fileid;
-	strncpy(key.sk_mntonname,
-	    vp->v_mount->mnt_stat.f_mntonname, MNAMELEN);
-
-	entry = get_prison_list_entry(ucred->cr_prison->pr_id);
 
-	PE_RLOCK(entry);
-	if (entry->sp_num_integriforce_rules) {
-		key.sk_type = secadm_integriforce_rule;
-		r.sr_key = fnv_32_buf(&key, sizeof(secadm_key_t), FNV1_32_INIT);
+	SECADM_EPOCH_ENTER(et);
+	rs = SECADM_RULESET(entry);
 
-		rule = RB_FIND(secadm_rules_tree, &(entry->sp_rules), &r);
-
-		if (rule) {
-			if (rule->sr_active ||
-			    (entry->sp_integriforce_flags & SECADM_INTEGRIFORCE_FLAGS_WHITELIST)) {
-				printf(
-				    "[SECADM] Prevented unlink of (%s): "
-				    "protected by a SECADM rule.\n",
-				    rule->sr_integriforce_data->si_path);
-
-				PE_RUNLOCK(entry);
-				return (EPERM);
-			}
-		}
+	if (!secadm_filter_query(&(rs->ss_filter), &key)) {
+		SECADM_EPOCH_EXIT(et);
+		return (0);
 	}
 
-	if (entry->sp_num_pax_rules) {
-		key.sk_type = secadm_pax_rule;
-		r.sr_key = fnv_32_buf(&key, sizeof(secadm_key_t), FNV1_32_INIT);
-
-		rule = RB_FIND(secadm_rules_tree, &(entry->sp_rules), &r);
+	if ((f = kernel_lookup_file(rs, &key)) == NULL) {
+		SECADM_EPOCH_EXIT(et);
+		return (0);
+	}
 
-		if (rule && rule->sr_active) {
+	if ((rule = f->sfi_integriforce) != NULL) {
+		if (SECADM_RULE_ACTIVE(rule) ||
+		    (entry->sp_integriforce_flags & SECADM_INTEGRIFORCE_FLAGS_WHITELIST)) {
 			printf(
 			    "[SECADM] Prevented unlink of (%s): "
 			    "protected by a SECADM rule.\n",
-			    rule->sr_pax_data->sp_path);
+			    rule->sr_integriforce_data->si_path);
 
-			PE_RUNLOCK(entry);
+			SECADM_EPOCH_EXIT(et);
 			return (EPERM);
 		}
 	}
 
-	PE_RUNLOCK(entry);
+	if ((rule = f->sfi_pax) != NULL && SECADM_RULE_ACTIVE(rule)) {
+		printf(
+		    "[SECADM] Prevented unlink of (%s): "
+		    "protected by a SECADM rule.\n",
+		    rule->sr_pax_data->sp_path);
+
+		SECADM_EPOCH_EXIT(et);
+		return (EPERM);
+	}
+
+	SECADM_EPOCH_EXIT(et);
 	return (0);
 }
@@ -26,6 +26,7 @@
 
 #include <sys/param.h>
 
+#include <sys/epoch.h>
 #include <sys/fcntl.h>
 #include <sys/imgact.h>
 #include <sys/jail.h>
@@ -39,7 +40,6 @@
 #include <sys/proc.h>
 #include <sys/stat.h>
 #include <sys/sx.h>
-#include <sys/tree.h>
 #include <sys/vnode.h>
 
 #include <security/mac/mac_policy.h>
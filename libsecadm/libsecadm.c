@@ -309,7 +309,7 @@ _secadm_get_rule_hash(secadm_rule_t *rule)
 	cmd.sc_version = SECADM_VERSION;
 	cmd.sc_type = secadm_cmd_get_rule_hash;
 
-	if ((rule_hash = calloc(1, SECADM_SHA256_DIGEST_LEN + 1)) == NULL) {
+	if ((rule_hash = calloc(1, SECADM_MAX_DIGEST_LEN + 1)) == NULL) {
 		perror("calloc");
 		return NULL;
 	}
@@ -479,6 +479,30 @@ secadm_get_tpe_gid(void)
 	return (gid);
 }
 
+int
+secadm_get_preverify_status(secadm_preverify_status_t *status)
+{
+	secadm_command_t cmd;
+	secadm_reply_t reply;
+	int err;
+
+	memset(&cmd, 0x00, sizeof(secadm_command_t));
+	memset(&reply, 0x00, sizeof(secadm_reply_t));
+	memset(status, 0x00, sizeof(secadm_preverify_status_t));
+
+	cmd.sc_version = SECADM_VERSION;
+	cmd.sc_type = secadm_cmd_get_preverify_status;
+	reply.sr_data = status;
+
+	if ((err = _secadm_sysctl(&cmd, &reply))) {
+		fprintf(stderr, "unable to get the preverification status. "
+		    "error code: %d\n", err);
+		return (err);
+	}
+
+	return (0);
+}
+
 void
 secadm_free_rule(secadm_rule_t *rule)
 {
@@ -576,6 +600,8 @@ secadm_validate_rule(secadm_rule_t *rule)
 			break;
 		case secadm_hash_sha256:
 			break;
+		case secadm_hash_blake3:
+			break;
 		default:
 			fprintf(stderr,
 			    "Integriforce rule type invalid: %s\n",
@@ -30,17 +30,14 @@
 
 #include <sys/param.h>
 #include <sys/sysctl.h>
-#include <sys/tree.h>
-
-#ifndef _SYS_FNV_HASH_H_
-#include <sys/fnv_hash.h>
-#endif /* !_SYS_FNV_HASH_H_ */
+#include <sys/queue.h>
+#include <sys/bitstring.h>
 
 #ifndef _SYS_PAX_H
 #include <sys/pax.h>
 #endif /* !_SYS_PAX_H */
 
-#define SECADM_VERSION			2017100201UL
+#define SECADM_VERSION			2026101702UL
 #define SECADM_PRETTY_VERSION		"0.5.1"
 
 #define SECADM_EXT_TYPE_ANY		0x0000007f
@@ -77,6 +74,7 @@
 
 #define SECADM_INTEGRIFORCE_FLAGS_NONE		0x00000000
 #define SECADM_INTEGRIFORCE_FLAGS_WHITELIST	0x00000001
+#define SECADM_INTEGRIFORCE_FLAGS_PREVERIFY	0x00000002
 
 #define SECADM_TPE_DISABLED		0x00000000
 #define SECADM_TPE_ENABLED		0x00000001
@@ -85,6 +83,8 @@
 
 #define SECADM_SHA1_DIGEST_LEN		20
 #define SECADM_SHA256_DIGEST_LEN	32
+#define SECADM_BLAKE3_DIGEST_LEN	32
+#define SECADM_MAX_DIGEST_LEN		32
 
 typedef enum secadm_rule_type {
 	secadm_pax_rule = 0,
@@ -109,7 +109,8 @@ typedef enum secadm_command_type {
 	secadm_cmd_set_tpe_flags,
 	secadm_cmd_get_tpe_flags,
 	secadm_cmd_set_tpe_gid,
-	secadm_cmd_get_tpe_gid
+	secadm_cmd_get_tpe_gid,
+	secadm_cmd_get_preverify_status
 } secadm_command_type_t;
 
 typedef struct secadm_command {
@@ -134,7 +135,6 @@ typedef uint32_t secadm_pax_t;
 typedef struct secadm_pax_data {
 	u_char		*sp_path;
 	size_t		 sp_pathsz;
-	char		 sp_mntonname[MNAMELEN];
 	long		 sp_fileid;
 	uint32_t	 sp_pax_set; 
 	secadm_pax_t	 sp_pax;
@@ -142,13 +142,13 @@ typedef struct secadm_pax_data {
 
 typedef enum secadm_hash_type {
 	secadm_hash_sha1 = 0,
-	secadm_hash_sha256
+	secadm_hash_sha256,
+	secadm_hash_blake3
 } secadm_hash_type_t;
 
 typedef struct secadm_integriforce_data {
 	u_char			*si_path;
 	size_t			 si_pathsz;
-	char			 si_mntonname[MNAMELEN];
 	long			 si_fileid;
 	secadm_hash_type_t	 si_type;
 	u_char			*si_hash;
@@ -156,6 +156,18 @@ typedef struct secadm_integriforce_data {
 	int			 si_mode;
 } secadm_integriforce_data_t;
 
+/*
+ * Progress of the background preverification of the published ruleset.
+ * It is done when ps_done reaches ps_total.
+ */
+typedef struct secadm_preverify_status {
+	u_int	 ps_total;
+	u_int	 ps_done;
+	u_int	 ps_verified;
+	u_int	 ps_mismatched;
+	u_int	 ps_unreadable;
+} secadm_preverify_status_t;
+
 typedef struct integriforce_so_check {
 	char	 isc_path[MAXPATHLEN];
 	int	 isc_result;
@@ -204,6 +216,16 @@ typedef struct secadm_extended_data {
 	secadm_extended_mode_t		 sm_mode;
 } secadm_extended_data_t;
 
+/*
+ * Identity of the file a rule applies to.  Filled in by the kernel; the
+ * padding is always zeroed so the whole structure can be hashed.
+ */
+typedef struct secadm_key {
+	fsid_t			 sk_fsid;
+	long			 sk_fileid;
+	secadm_rule_type_t	 sk_type;
+} secadm_key_t;
+
 typedef struct secadm_rule {
 	int					 sr_id;
 	int					 sr_jid;
@@ -214,9 +236,12 @@ typedef struct secadm_rule {
 		secadm_extended_data_t		*sr_extended_data;
 	};
 	int					 sr_active;
-	Fnv32_t					 sr_key;
+	secadm_key_t				 sr_key;
+	uint64_t				 sr_hash;
+	uint32_t				 sr_pax_flags;	/* PAX_NOTE_* */
+	u_int					 sr_refs;
 	struct secadm_rule			*sr_next;	/* XXX for loading only */
-	RB_ENTRY(secadm_rule)			 sr_tree;
+	TAILQ_ENTRY(secadm_rule)		 sr_entries;
 } secadm_rule_t;
 
 int secadm_flush_ruleset(void);
@@ -236,23 +261,51 @@ int secadm_set_tpe_flags(uint32_t);
 uint32_t secadm_get_tpe_flags(void);
 int secadm_set_tpe_gid(gid_t);
 gid_t secadm_get_tpe_gid(void);
+int secadm_get_preverify_status(secadm_preverify_status_t *);
 
 #ifdef _KERNEL
 
 struct secadm_prison_entry;
-
-int get_mntonname_vattr(struct thread *, u_char *, char *, struct vattr *);
+struct integriforce_shared;
+struct integriforce_preverify;
+
+int get_fsid_vattr(struct thread *, u_char *, fsid_t *, fsid_t *,
+    struct vattr *);
+void secadm_hash_init(void);
+uint64_t secadm_hash(secadm_key_t *);
+secadm_rule_t *kernel_alloc_rule(secadm_rule_type_t);
 void kernel_free_rule(secadm_rule_t *);
+struct secadm_verify *kernel_rule_verify(secadm_rule_t *);
+struct integriforce_shared **kernel_rule_shared(secadm_rule_t *);
+void secadm_rule_zones_init(void);
+void secadm_rule_zones_uninit(void);
+
+void secadm_intern_init(void);
+void secadm_intern_uninit(void);
+u_char *secadm_intern(const u_char *, size_t);
+void secadm_intern_release(u_char *);
+void kernel_rule_acquire(secadm_rule_t *);
+void kernel_rule_release(secadm_rule_t *);
+void kernel_flush_rules(struct secadm_prison_entry *);
 void kernel_flush_ruleset(int);
-int kernel_finalize_rule(struct thread *, secadm_rule_t *, int);
+void kernel_update_features(struct secadm_prison_entry *);
+int kernel_finalize_rule(struct thread *, secadm_rule_t *);
 int kernel_load_ruleset(struct thread *, secadm_rule_t *);
 int kernel_add_rule(struct thread *, secadm_rule_t *, int);
 void kernel_del_rule(struct thread *, secadm_rule_t *);
 void kernel_active_rule(struct thread *, secadm_rule_t *, int);
-secadm_rule_t *kernel_get_rule(struct thread *, secadm_rule_t *);
+secadm_rule_t *kernel_get_rule(struct secadm_prison_entry *, int, int);
 
 int secadm_sysctl_handler(SYSCTL_HANDLER_ARGS);
 
+void secadm_vnode_label_init(void);
+void secadm_vnode_init_label(struct label *);
+void secadm_vnode_destroy_label(struct label *);
+void secadm_vnode_associate_singlelabel(struct mount *, struct label *,
+    struct vnode *, struct label *);
+int secadm_vnode_associate_extattr(struct mount *, struct label *,
+    struct vnode *, struct label *);
+
 int secadm_vnode_check_exec(struct ucred *, struct vnode *, struct label *,
     struct image_params *, struct label *);
 int secadm_vnode_check_open(struct ucred *, struct vnode *, struct label *,
@@ -260,17 +313,29 @@ int secadm_vnode_check_open(struct ucred *, struct vnode *, struct label *,
 int secadm_vnode_check_unlink(struct ucred *, struct vnode *, struct label *,
     struct vnode *, struct label *,
     struct componentname *);
-
-int secadm_rule_cmp(secadm_rule_t *, secadm_rule_t *);
-
+int secadm_vnode_check_write(struct ucred *, struct ucred *, struct vnode *,
+    struct label *);
+int secadm_vnode_check_mmap(struct ucred *, struct vnode *, struct label *,
+    int, int);
+u_int secadm_vnode_watch_writes(struct vnode *);
+
+void integriforce_init(void);
+void integriforce_uninit(void);
+void integriforce_shared_init(void);
+void integriforce_shared_uninit(void);
+void integriforce_share(secadm_rule_t *, fsid_t *);
+void integriforce_unshare(secadm_rule_t *);
+struct vnode *integriforce_lower_vnode(struct vnode *);
+void integriforce_preverify(struct secadm_prison_entry *);
+void integriforce_preverify_status(struct secadm_prison_entry *,
+    secadm_preverify_status_t *);
 int do_integriforce_check(secadm_rule_t *, struct vattr *, struct vnode *,
     struct ucred *);
 
 int tpe_check(struct image_params *imgp, struct secadm_prison_entry *);
 
 MALLOC_DECLARE(M_SECADM);
-RB_HEAD(secadm_rules_tree, secadm_rule);
-RB_PROTOTYPE(secadm_rules_tree, secadm_rule, sr_tree, secadm_rule_cmp);
+TAILQ_HEAD(secadm_rule_list, secadm_rule);
 
 #define PE_INIT(l)	sx_init(&(l)->sp_lock, "secadm prison sxlock");
 #define PE_RLOCK(l)	sx_slock(&(l)->sp_lock)
@@ -286,35 +351,206 @@ RB_PROTOTYPE(secadm_rules_tree, secadm_rule, sr_tree, secadm_rule_cmp);
 #define PL_WUNLOCK()	sx_xunlock(&(secadm_prisons_list.sp_lock));
 #define PL_DESTROY()	sx_destroy(&(secadm_prisons_list.sp_lock));
 
-typedef struct secadm_key {
-	int			 sk_jid;
-	secadm_rule_type_t	 sk_type;
-	long			 sk_fileid;
-	char			 sk_mntonname[MNAMELEN];
-} secadm_key_t;
+#define SECADM_TABLE_GROUP	8
+
+struct secadm_table_gen {
+	uint8_t			 *stg_ctrl;
+	secadm_key_t		**stg_slots;
+	size_t			  stg_ngroups;
+	size_t			  stg_used;
+};
+
+typedef struct secadm_table {
+	struct secadm_table_gen	 st_cur;
+	struct secadm_table_gen	 st_old;	/* being migrated into st_cur */
+	size_t			 st_migrate;
+	size_t			 st_count;
+} secadm_table_t;
+
+void secadm_table_init(secadm_table_t *);
+void secadm_table_reserve(secadm_table_t *, size_t);
+void secadm_table_destroy(secadm_table_t *);
+secadm_key_t *secadm_table_lookup(secadm_table_t *, secadm_key_t *, uint64_t);
+void secadm_table_insert(secadm_table_t *, secadm_key_t *, uint64_t);
+void secadm_table_remove(secadm_table_t *, secadm_key_t *, uint64_t);
+
+#define SECADM_FILTER_WORDS	8
+
+struct secadm_filter_block {
+	uint32_t		 sfb_words[SECADM_FILTER_WORDS];
+} __aligned(32);
+
+typedef struct secadm_filter {
+	struct secadm_filter_block	*sf_blocks;
+	size_t				 sf_nblocks;
+	uint64_t			 sf_seed;
+} secadm_filter_t;
+
+void secadm_filter_init(void);
+void secadm_filter_uninit(void);
+struct secadm_file;
+
+void secadm_filter_build(secadm_filter_t *, struct secadm_file *, size_t);
+void secadm_filter_destroy(secadm_filter_t *);
+int secadm_filter_query(secadm_filter_t *, secadm_key_t *);
+void secadm_filter_false_positive(void);
+
+#define SECADM_BLAKE3_BLOCK_LEN		64
+#define SECADM_BLAKE3_CHUNK_BLOCKS	16	/* 1 KB chunks */
+#define SECADM_BLAKE3_MAX_DEPTH		54	/* 2^64 bytes of input */
+
+typedef struct secadm_blake3_ctx {
+	uint32_t		 sb_cv[8];
+	uint64_t		 sb_chunk;
+	uint8_t			 sb_block[SECADM_BLAKE3_BLOCK_LEN];
+	uint8_t			 sb_block_len;
+	uint8_t			 sb_blocks;
+	uint8_t			 sb_depth;
+	uint32_t		 sb_stack[SECADM_BLAKE3_MAX_DEPTH][8];
+} secadm_blake3_ctx_t;
+
+void secadm_blake3_init(secadm_blake3_ctx_t *);
+void secadm_blake3_update(secadm_blake3_ctx_t *, const void *, size_t);
+void secadm_blake3_final(secadm_blake3_ctx_t *,
+    u_char [SECADM_BLAKE3_DIGEST_LEN]);
+
+/*
+ * Everything a ruleset says about one file.  Records are keyed on the
+ * file alone, with sk_type zero, so the hooks find all of a file's
+ * rules with a single lookup.
+ */
+typedef struct secadm_file {
+	secadm_key_t				 sfi_key;
+	secadm_rule_t				*sfi_integriforce;
+	secadm_rule_t				*sfi_pax;
+} secadm_file_t;
+
+/*
+ * Immutable view of a prison's live rules.  Writers build a new one
+ * under the prison lock and publish it; the hooks read the current one
+ * inside a secadm_epoch section without taking any lock.  Each ruleset
+ * holds a reference on every rule in it.
+ */
+typedef struct secadm_ruleset {
+	secadm_filter_t				 ss_filter;
+	secadm_table_t				 ss_table;	/* of ss_files */
+	secadm_file_t				*ss_files;
+	size_t					 ss_num_files;
+	secadm_rule_t				**ss_rules;
+	size_t					 ss_num_rules;
+	size_t					 ss_num_integriforce_rules;
+	size_t					 ss_num_pax_rules;
+	size_t					 ss_num_extended_rules;
+} secadm_ruleset_t;
+
+void kernel_free_ruleset(secadm_ruleset_t *);
+secadm_file_t *kernel_lookup_file(secadm_ruleset_t *, secadm_key_t *);
+
+extern epoch_t secadm_epoch;
+
+#define SECADM_EPOCH_ENTER(et)	epoch_enter_preempt(secadm_epoch, &(et))
+#define SECADM_EPOCH_EXIT(et)	epoch_exit_preempt(secadm_epoch, &(et))
+
+#define SECADM_RULESET(l)						\
+	((secadm_ruleset_t *)atomic_load_acq_ptr(			\
+	    (volatile uintptr_t *)&(l)->sp_ruleset))
+#define SECADM_GENERATION(l)	atomic_load_acq_64(&(l)->sp_gen)
+
+/*
+ * sr_active is the one field of a published rule that still changes.
+ * Hooks read it without the prison lock, possibly after dropping the
+ * epoch section while holding a reference.
+ */
+#define SECADM_RULE_ACTIVE(r)						\
+	atomic_load_int((volatile u_int *)&(r)->sr_active)
+
+/*
+ * What a prison has configured, for hooks to bail out on before doing
+ * any work.  Kept up to date by kernel_update_features().
+ */
+#define	SECADM_FEATURE_INTEGRIFORCE	0x00000001
+#define	SECADM_FEATURE_PAX		0x00000002
+#define	SECADM_FEATURE_TPE		0x00000004
+#define	SECADM_FEATURE_WHITELIST	0x00000008	/* with INTEGRIFORCE */
+#define	SECADM_FEATURE_MASK		0x0000000f
+
+#define SECADM_FEATURES(l)	atomic_load_acq_int(&(l)->sp_features)
+
+/*
+ * The exec hook proper, specialized for a prison's feature word and
+ * swapped whenever that changes.
+ */
+typedef int (*secadm_exec_handler_t)(struct secadm_prison_entry *,
+    struct ucred *, struct vnode *, struct label *, struct image_params *);
+
+secadm_exec_handler_t secadm_vnode_exec_handler(u_int);
+
+#define SECADM_EXEC_HANDLER(l)						\
+	((secadm_exec_handler_t)atomic_load_acq_ptr(			\
+	    (volatile uintptr_t *)&(l)->sp_exec))
+
+/*
+ * The outcome of an Integriforce rule's last hash check, stamped with
+ * the state of the file it was computed on.  It is reused for as long
+ * as the file still carries that stamp.  Updated under a sequence count
+ * like the vnode label cache, by whoever holds SECADM_VERIFY_BUSY.
+ * sv_flags is protected by the pool mutex for the structure's address.
+ */
+#define	SECADM_VERIFY_NONE	0
+#define	SECADM_VERIFY_OK	1
+#define	SECADM_VERIFY_MISMATCH	2
+
+#define	SECADM_VERIFY_BUSY	0x00000001	/* being hashed */
+#define	SECADM_VERIFY_WANTED	0x00000002	/* someone is waiting */
+
+struct secadm_verify {
+	volatile u_int		 sv_seq;
+	u_int			 sv_flags;
+	int			 sv_state;
+	u_int			 sv_writes;
+	u_quad_t		 sv_filerev;
+	u_quad_t		 sv_size;
+	struct timespec		 sv_mtime;
+	struct timespec		 sv_ctime;
+};
+
+extern int secadm_slot;
 
 typedef struct secadm_prison_entry {
-	struct secadm_rules_tree		 sp_rules;
-	struct secadm_rules_tree		 sp_staging;
-	size_t					 sp_num_rules;
-	size_t					 sp_last_id;
-	size_t					 sp_num_integriforce_rules;
-	size_t					 sp_num_pax_rules;
-	size_t					 sp_num_extended_rules;
+	secadm_rule_t				**sp_ids;	/* by sr_id */
+	bitstr_t				*sp_idmap;	/* IDs in use */
+	int					 sp_ids_size;
+	secadm_ruleset_t			*sp_ruleset;
+	uint64_t				 sp_gen;
+	volatile u_int				 sp_features;
+	secadm_exec_handler_t			 sp_exec;
+	struct secadm_rule_list			 sp_staging;
+	secadm_table_t				 sp_staging_index;
 	int					 sp_loaded;
 	int					 sp_id;
 	int					 sp_integriforce_flags;
+	struct integriforce_preverify		*sp_preverify;
 	struct sx				 sp_lock;
 	gid_t					 sp_tpe_gid;
 	uint32_t				 sp_tpe_flags;
-	SLIST_ENTRY(secadm_prison_entry)	 sp_entries;
+	struct secadm_prison_entry		*sp_next;	/* hash chain */
 } secadm_prison_entry_t;
 
 secadm_prison_entry_t *get_prison_list_entry(int);
+secadm_prison_entry_t *lookup_prison_list_entry(int);
+
+/* Power of two.  Jail IDs are handed out sequentially. */
+#define	SECADM_PRISON_BUCKETS		1024
+#define	SECADM_PRISON_BUCKET(jid)	((u_int)(jid) & (SECADM_PRISON_BUCKETS - 1))
 
+/*
+ * Entries are chained by jail ID and stay put until the module is
+ * unloaded.  Chains only ever grow at the head, so they can be walked
+ * without the lock; sp_lock serializes insertions.
+ */
 typedef struct secadm_prisons {
-	SLIST_HEAD(secadm_prison_list, secadm_prison_entry)	 sp_prison;
-	struct sx                                           	 sp_lock;
+	secadm_prison_entry_t	*sp_buckets[SECADM_PRISON_BUCKETS];
+	struct sx		 sp_lock;
 } secadm_prisons_t;
 
 extern secadm_prisons_t secadm_prisons_list;
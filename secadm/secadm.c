@@ -60,6 +60,8 @@ int set_action(int, char **);
 int tpe_action(int, char **);
 
 void free_ruleset(secadm_rule_t *);
+const char *hash_type_name(secadm_hash_type_t);
+size_t hash_type_len(secadm_hash_type_t);
 
 void emit_rules_xo(secadm_rule_t **, size_t, int);
 void emit_rules_ucl(secadm_rule_t **, size_t);
@@ -348,8 +350,8 @@ show_action(int argc, char **argv)
 		case secadm_integriforce_rule:
 			printf("integriforce %s %s %s ",
 			    ruleset[i]->sr_integriforce_data->si_path,
-			    (ruleset[i]->sr_integriforce_data->si_type ==
-			     secadm_hash_sha1 ? "sha1" : "sha256"),
+			    hash_type_name(
+			    ruleset[i]->sr_integriforce_data->si_type),
 			    (ruleset[i]->sr_integriforce_data->si_mode ==
 			     0 ? "soft" : "hard"));
 
@@ -367,6 +369,14 @@ show_action(int argc, char **argv)
 					printf("%02x",
 					    ruleset[i]->sr_integriforce_data->si_hash[j]);
 				}
+
+				break;
+
+			case secadm_hash_blake3:
+				for (j = 0; j < SECADM_BLAKE3_DIGEST_LEN; j++) {
+					printf("%02x",
+					    ruleset[i]->sr_integriforce_data->si_hash[j]);
+				}
 			}
 
 			printf("\n");
@@ -391,7 +401,7 @@ load_action(int argc, char **argv)
 	secadm_rule_t *ruleset, *rule, *r;
 	struct ucl_parser *parser;
 	ucl_object_iter_t it;
-	int flags, tpe_set;
+	int flags, flags_set, tpe_set;
 	uint32_t tpe_flags;
 	const char *val;
 	gid_t tpe_gid;
@@ -504,20 +514,41 @@ load_action(int argc, char **argv)
 		}
 
 		if (validate == 0) {
+			flags = secadm_get_integriforce_flags();
+			flags_set = 0;
+
 			cur = ucl_lookup_path(top, "secadm.whitelist_mode");
 			if (cur) {
 				if (ucl_object_toboolean(cur)) {
-					flags = SECADM_INTEGRIFORCE_FLAGS_WHITELIST;
+					flags |= SECADM_INTEGRIFORCE_FLAGS_WHITELIST;
 				} else {
-					flags = SECADM_INTEGRIFORCE_FLAGS_NONE;
+					flags &= ~(SECADM_INTEGRIFORCE_FLAGS_WHITELIST);
 				}
 
-				if (secadm_set_integriforce_flags(flags)) {
-					fprintf(stderr, "[-] Could not set whitelist mode\n");
-					ucl_parser_free(parser);
+				flags_set = 1;
+			}
 
-					return (1);
+			/*
+			 * Set before the ruleset is loaded below, so the
+			 * load starts preverifying it.
+			 */
+			cur = ucl_lookup_path(top, "secadm.preverify");
+			if (cur) {
+				if (ucl_object_toboolean(cur)) {
+					flags |= SECADM_INTEGRIFORCE_FLAGS_PREVERIFY;
+				} else {
+					flags &= ~(SECADM_INTEGRIFORCE_FLAGS_PREVERIFY);
 				}
+
+				flags_set = 1;
+			}
+
+			if (flags_set &&
+			    secadm_set_integriforce_flags(flags)) {
+				fprintf(stderr, "[-] Could not set Integriforce flags\n");
+				ucl_parser_free(parser);
+
+				return (1);
 			}
 		}
 	}
@@ -589,26 +620,34 @@ load_action(int argc, char **argv)
 int
 set_action(int argc, char **argv)
 {
-	int ch;
+	int ch, flags;
+
+	flags = secadm_get_integriforce_flags();
 
 	optind = 2;
-	while ((ch = getopt(argc, argv, "Ww")) != -1) {
+	while ((ch = getopt(argc, argv, "PpWw")) != -1) {
 		switch (ch) {
 		case 'w':
 			printf("Unsetting whitelist\n");
-			if (secadm_set_integriforce_flags(SECADM_INTEGRIFORCE_FLAGS_NONE)) {
-				fprintf(stderr, "[-] Could not unset whitelist mode\n");
-				return (1);
-			}
+			flags &= ~(SECADM_INTEGRIFORCE_FLAGS_WHITELIST);
 
 			break;
 
 		case 'W':
 			printf("Setting whitelist\n");
-			if (secadm_set_integriforce_flags(SECADM_INTEGRIFORCE_FLAGS_WHITELIST)) {
-				fprintf(stderr, "[-] Could not set whitelist mode\n");
-				return (1);
-			}
+			flags |= SECADM_INTEGRIFORCE_FLAGS_WHITELIST;
+
+			break;
+
+		case 'p':
+			printf("Unsetting preverification\n");
+			flags &= ~(SECADM_INTEGRIFORCE_FLAGS_PREVERIFY);
+
+			break;
+
+		case 'P':
+			printf("Setting preverification\n");
+			flags |= SECADM_INTEGRIFORCE_FLAGS_PREVERIFY;
 
 			break;
 
@@ -618,6 +657,11 @@ set_action(int argc, char **argv)
 		}
 	}
 
+	if (secadm_set_integriforce_flags(flags)) {
+		fprintf(stderr, "[-] Could not set Integriforce flags\n");
+		return (1);
+	}
+
 	return (0);
 }
 
@@ -697,6 +741,7 @@ tpe_action(int argc, char **argv)
 int
 get_action(int argc, char **argv)
 {
+	secadm_preverify_status_t status;
 	int flags;
 	gid_t gid;
 
@@ -708,6 +753,21 @@ get_action(int argc, char **argv)
 		printf("Whitelist:\toff\n");
 	}
 
+	if (flags & SECADM_INTEGRIFORCE_FLAGS_PREVERIFY) {
+		printf("Preverify:\ton\n");
+		if (secadm_get_preverify_status(&status) == 0) {
+			printf("   Done:\t%u/%u%s\n", status.ps_done,
+			    status.ps_total,
+			    (status.ps_done < status.ps_total) ?
+			    " (running)" : "");
+			printf("   Verified:\t%u\n", status.ps_verified);
+			printf("   Mismatched:\t%u\n", status.ps_mismatched);
+			printf("   Unreadable:\t%u\n", status.ps_unreadable);
+		}
+	} else {
+		printf("Preverify:\toff\n");
+	}
+
 	flags = (int)secadm_get_tpe_flags();
 	if ((flags & SECADM_TPE_ENABLED)) {
 		printf("TPE:\t\ton\n");
@@ -922,6 +982,8 @@ add_action(int argc, char **argv)
 			rule->sr_integriforce_data->si_type = secadm_hash_sha1;
 		} else if (!strncmp(argv[4], "sha256", 6)) {
 			rule->sr_integriforce_data->si_type = secadm_hash_sha256;
+		} else if (!strncmp(argv[4], "blake3", 6)) {
+			rule->sr_integriforce_data->si_type = secadm_hash_blake3;
 		} else {
 			usage(3, argv);
 			secadm_free_rule(rule);
@@ -972,22 +1034,26 @@ add_action(int argc, char **argv)
 			break;
 
 		case secadm_hash_sha256:
+		case secadm_hash_blake3:
 			if ((rule->sr_integriforce_data->si_hash =
-			    calloc(1, SECADM_SHA256_DIGEST_LEN)) == NULL) {
+			    calloc(1, hash_type_len(
+			    rule->sr_integriforce_data->si_type))) == NULL) {
 				perror("calloc");
 				secadm_free_rule(rule);
 
 				return (1);
 			}
 
-			if (strlen(argv[6]) != SECADM_SHA256_DIGEST_LEN * 2) {
+			if (strlen(argv[6]) != hash_type_len(
+			    rule->sr_integriforce_data->si_type) * 2) {
 				fprintf(stderr, "Invalid hash.\n");
 				secadm_free_rule(rule);
 
 				return (1);
 			}
 
-			for (i = 0; i < 64; i += 2) {
+			for (i = 0; i < hash_type_len(
+			    rule->sr_integriforce_data->si_type) * 2; i += 2) {
 				if (sscanf(&argv[6][i], "%02x", &val) == 0) {
 					fprintf(stderr, "Invalid hash.\n");
 					secadm_free_rule(rule);
@@ -1076,7 +1142,7 @@ version_action(int argc, char **argv)
 void
 emit_rules_xo(secadm_rule_t **ruleset, size_t num_rules, int style)
 {
-	char hash[SECADM_SHA256_DIGEST_LEN * 2 + 1];
+	char hash[SECADM_MAX_DIGEST_LEN * 2 + 1];
 	int i, j;
 
 	xo_set_style(NULL, style);
@@ -1143,11 +1209,8 @@ emit_rules_xo(secadm_rule_t **ruleset, size_t num_rules, int style)
 
 	for (i = 0; i < num_rules; i++) {
 		if (ruleset[i]->sr_type == secadm_integriforce_rule) {
-			for (j = 0;
-			     j < (ruleset[i]->sr_integriforce_data->si_type ==
-			     secadm_hash_sha1 ?
-			     SECADM_SHA1_DIGEST_LEN :
-			     SECADM_SHA256_DIGEST_LEN); j++) {
+			for (j = 0; j < hash_type_len(
+			     ruleset[i]->sr_integriforce_data->si_type); j++) {
 				snprintf(&hash[j * 2], 3, "%02x",
 				    ruleset[i]->sr_integriforce_data->si_hash[j]);
 			}
@@ -1160,8 +1223,8 @@ emit_rules_xo(secadm_rule_t **ruleset, size_t num_rules, int style)
 			    "{:mode/%s}",
 			    ruleset[i]->sr_integriforce_data->si_path,
 			    hash,
-			    (ruleset[i]->sr_integriforce_data->si_type ==
-			     0 ? "sha1" : "sha256"),
+			    hash_type_name(
+			    ruleset[i]->sr_integriforce_data->si_type),
 			    (ruleset[i]->sr_integriforce_data->si_mode ==
 			     secadm_hash_sha1 ? "soft" : "hard"));
 			xo_close_instance_d();
@@ -1176,7 +1239,7 @@ emit_rules_xo(secadm_rule_t **ruleset, size_t num_rules, int style)
 void
 emit_rules_ucl(secadm_rule_t **ruleset, size_t num_rules)
 {
-	char hash[SECADM_SHA256_DIGEST_LEN * 2 + 1];
+	char hash[SECADM_MAX_DIGEST_LEN * 2 + 1];
 	size_t i, j;
 
 	printf("secadm {\n");
@@ -1235,11 +1298,8 @@ emit_rules_ucl(secadm_rule_t **ruleset, size_t num_rules)
 
 	for (i = 0; i < num_rules; i++) {
 		if (ruleset[i]->sr_type == secadm_integriforce_rule) {
-			for (j = 0;
-			     j < (ruleset[i]->sr_integriforce_data->si_type ==
-			     secadm_hash_sha1 ?
-			     SECADM_SHA1_DIGEST_LEN :
-			     SECADM_SHA256_DIGEST_LEN); j++) {
+			for (j = 0; j < hash_type_len(
+			     ruleset[i]->sr_integriforce_data->si_type); j++) {
 				snprintf(&hash[j * 2], 3, "%02x",
 				    ruleset[i]->sr_integriforce_data->si_hash[j]);
 			}
@@ -1252,8 +1312,8 @@ emit_rules_ucl(secadm_rule_t **ruleset, size_t num_rules)
 			    "        mode = \"%s\";\n    }\n",
 			    ruleset[i]->sr_integriforce_data->si_path,
 			    hash,
-			    (ruleset[i]->sr_integriforce_data->si_type ==
-			     0 ? "sha1" : "sha256"),
+			    hash_type_name(
+			    ruleset[i]->sr_integriforce_data->si_type),
 			    (ruleset[i]->sr_integriforce_data->si_mode ==
 			     secadm_hash_sha1 ? "soft" : "hard"));
 		}
@@ -1279,6 +1339,38 @@ free_ruleset(secadm_rule_t *ruleset)
 	} while (rule != NULL);
 }
 
+const char *
+hash_type_name(secadm_hash_type_t type)
+{
+
+	switch (type) {
+	case secadm_hash_sha1:
+		return ("sha1");
+	case secadm_hash_sha256:
+		return ("sha256");
+	case secadm_hash_blake3:
+		return ("blake3");
+	}
+
+	return ("unknown");
+}
+
+size_t
+hash_type_len(secadm_hash_type_t type)
+{
+
+	switch (type) {
+	case secadm_hash_sha1:
+		return (SECADM_SHA1_DIGEST_LEN);
+	case secadm_hash_sha256:
+		return (SECADM_SHA256_DIGEST_LEN);
+	case secadm_hash_blake3:
+		return (SECADM_BLAKE3_DIGEST_LEN);
+	}
+
+	return (0);
+}
+
 int
 parse_pax_object(const ucl_object_t *obj, secadm_rule_t *rule)
 {
@@ -1421,6 +1513,8 @@ int parse_integriforce_object(const ucl_object_t *obj, secadm_rule_t *rule)
 		rule->sr_integriforce_data->si_type = secadm_hash_sha1;
 	} else if (!strncmp(type, "sha256", 6)) {
 		rule->sr_integriforce_data->si_type = secadm_hash_sha256;
+	} else if (!strncmp(type, "blake3", 6)) {
+		rule->sr_integriforce_data->si_type = secadm_hash_blake3;
 	} else {
 		fprintf(stderr, "Integriforce rule has invalid hash type.\n");
 		return (1);
@@ -1467,13 +1561,16 @@ int parse_integriforce_object(const ucl_object_t *obj, secadm_rule_t *rule)
 		break;
 
 	case secadm_hash_sha256:
+	case secadm_hash_blake3:
 		if ((rule->sr_integriforce_data->si_hash =
-		     calloc(1, SECADM_SHA256_DIGEST_LEN)) == NULL) {
+		     calloc(1, hash_type_len(
+		     rule->sr_integriforce_data->si_type))) == NULL) {
 			perror("calloc");
 			return (1);
 		}
 
-		if (strlen(hash) != SECADM_SHA256_DIGEST_LEN * 2) {
+		if (strlen(hash) != hash_type_len(
+		    rule->sr_integriforce_data->si_type) * 2) {
 			fprintf(stderr,
 			    "Integriforce rule has invalid hash: %s\n",
 			    rule->sr_integriforce_data->si_path);
@@ -1482,7 +1579,8 @@ int parse_integriforce_object(const ucl_object_t *obj, secadm_rule_t *rule)
 			return (1);
 		}
 
-		for (i = 0; i < 64; i += 2) {
+		for (i = 0; i < hash_type_len(
+		    rule->sr_integriforce_data->si_type) * 2; i += 2) {
 			if (sscanf(&hash[i], "%02x", &val) == 0) {
 				fprintf(stderr, "Invalid hash.\n");
 				return (1);
@@ -0,0 +1,233 @@
+/*-
+ * Copyright (c) 2026 The HardenedBSD Project
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Userspace versions of what the module's sources get from the rest of
+ * the kernel, plus helpers shared by the tests and benchmarks.
+ */
+
+#include <sys/types.h>
+
+#include <sched.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "harness.h"
+
+uint64_t harness_hash_mask = ~(uint64_t)0;
+
+/* The module keys SipHash-2-4 with a secret picked at load time. */
+static uint8_t harness_hash_secret[16];
+
+#define	ROTL(x, b)	(uint64_t)(((x) << (b)) | ((x) >> (64 - (b))))
+
+#define	SIPROUND(v0, v1, v2, v3) do {					\
+	v0 += v1; v1 = ROTL(v1, 13); v1 ^= v0; v0 = ROTL(v0, 32);	\
+	v2 += v3; v3 = ROTL(v3, 16); v3 ^= v2;				\
+	v0 += v3; v3 = ROTL(v3, 21); v3 ^= v0;				\
+	v2 += v1; v1 = ROTL(v1, 17); v1 ^= v2; v2 = ROTL(v2, 32);	\
+} while (0)
+
+static uint64_t
+harness_le64(const uint8_t *p)
+{
+	uint64_t v;
+	int i;
+
+	for (v = 0, i = 7; i >= 0; i--)
+		v = (v << 8) | p[i];
+
+	return (v);
+}
+
+uint64_t
+harness_siphash24(const uint8_t *key, const void *src, size_t len)
+{
+	const uint8_t *p;
+	uint64_t k0, k1, v0, v1, v2, v3, m;
+	size_t i, left;
+
+	k0 = harness_le64(key);
+	k1 = harness_le64(key + 8);
+	v0 = k0 ^ 0x736f6d6570736575ULL;
+	v1 = k1 ^ 0x646f72616e646f6dULL;
+	v2 = k0 ^ 0x6c7967656e657261ULL;
+	v3 = k1 ^ 0x7465646279746573ULL;
+
+	p = src;
+	for (i = 0; i + 8 <= len; i += 8) {
+		m = harness_le64(p + i);
+		v3 ^= m;
+		SIPROUND(v0, v1, v2, v3);
+		SIPROUND(v0, v1, v2, v3);
+		v0 ^= m;
+	}
+
+	m = (uint64_t)len << 56;
+	for (left = len - i; left > 0; left--)
+		m |= (uint64_t)p[i + left - 1] << (8 * (left - 1));
+
+	v3 ^= m;
+	SIPROUND(v0, v1, v2, v3);
+	SIPROUND(v0, v1, v2, v3);
+	v0 ^= m;
+
+	v2 ^= 0xff;
+	SIPROUND(v0, v1, v2, v3);
+	SIPROUND(v0, v1, v2, v3);
+	SIPROUND(v0, v1, v2, v3);
+	SIPROUND(v0, v1, v2, v3);
+
+	return (v0 ^ v1 ^ v2 ^ v3);
+}
+
+void
+secadm_hash_init(void)
+{
+
+	arc4random_buf(harness_hash_secret, sizeof(harness_hash_secret));
+}
+
+uint64_t
+secadm_hash(secadm_key_t *key)
+{
+
+	return (harness_siphash24(harness_hash_secret, key,
+	    sizeof(secadm_key_t)) & harness_hash_mask);
+}
+
+/*
+ * Distinct n give distinct keys.  Keys are spread over a few file
+ * systems, the way a ruleset covers a few mounts, and their padding is
+ * zeroed as the module does before hashing.
+ */
+void
+harness_key(secadm_key_t *key, uint64_t n, secadm_rule_type_t type)
+{
+	int32_t fsid[2];
+
+	memset(key, 0x00, sizeof(secadm_key_t));
+
+	fsid[0] = (int32_t)(n % 4) + 0x5ec0;
+	fsid[1] = 0x0adb;
+	memcpy(&(key->sk_fsid), fsid, sizeof(fsid));
+	key->sk_fileid = (long)(n / 4) + 2;
+	key->sk_type = type;
+}
+
+/* splitmix64 */
+uint64_t
+harness_random(uint64_t *state)
+{
+	uint64_t z;
+
+	z = (*state += 0x9e3779b97f4a7c15ULL);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+
+	return (z ^ (z >> 31));
+}
+
+/* The 32-bit FNV-1 hash the rule tree used to be keyed on. */
+uint32_t
+harness_fnv32(const void *buf, size_t len)
+{
+	const uint8_t *p;
+	uint32_t h;
+
+	for (h = 0x811c9dc5, p = buf; len > 0; len--, p++) {
+		h *= 0x01000193;
+		h ^= *p;
+	}
+
+	return (h);
+}
+
+uint64_t
+harness_nsec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ((uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec);
+}
+
+void
+harness_epoch_init(struct harness_epoch *he, int nrecords)
+{
+
+	he->he_records = aligned_alloc(64,
+	    nrecords * sizeof(struct harness_epoch_record));
+	memset(he->he_records, 0x00,
+	    nrecords * sizeof(struct harness_epoch_record));
+	he->he_nrecords = nrecords;
+}
+
+void
+harness_epoch_destroy(struct harness_epoch *he)
+{
+
+	free(he->he_records);
+}
+
+void
+harness_epoch_wait(struct harness_epoch *he)
+{
+	unsigned long seq;
+	int i;
+
+	/* Order the caller's unpublishing before the reads below. */
+	atomic_thread_fence(memory_order_seq_cst);
+
+	for (i = 0; i < he->he_nrecords; i++) {
+		seq = atomic_load_explicit(&(he->he_records[i].her_seq),
+		    memory_order_acquire);
+		if ((seq & 1) == 0)
+			continue;
+
+		while (atomic_load_explicit(&(he->he_records[i].her_seq),
+		    memory_order_acquire) == seq)
+			sched_yield();
+	}
+}
+
+void
+harness_fail(const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	fprintf(stderr, "FAIL: ");
+	vfprintf(stderr, fmt, ap);
+	fprintf(stderr, "\n");
+	va_end(ap);
+
+	exit(1);
+}
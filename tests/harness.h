@@ -0,0 +1,87 @@
+/*-
+ * Copyright (c) 2026 The HardenedBSD Project
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _SECADM_TEST_HARNESS_H_
+#define	_SECADM_TEST_HARNESS_H_
+
+#include <stdatomic.h>
+
+#include "secadm.h"
+
+/*
+ * secadm_hash() results are masked with this.  Tests narrow it to force
+ * keys into long probe chains; it is all ones otherwise.
+ */
+extern uint64_t harness_hash_mask;
+
+uint64_t harness_siphash24(const uint8_t *, const void *, size_t);
+void harness_key(secadm_key_t *, uint64_t, secadm_rule_type_t);
+uint64_t harness_random(uint64_t *);
+uint32_t harness_fnv32(const void *, size_t);
+uint64_t harness_nsec(void);
+void harness_fail(const char *, ...);
+
+/*
+ * A minimal stand-in for epoch(9).  A reader bumps its own sequence
+ * number on entry and on exit, so it is inside a section while the
+ * number is odd, and it never writes a cache line another thread
+ * writes.  harness_epoch_wait() returns once every reader that was
+ * inside a section when it was called has left it.
+ */
+struct harness_epoch_record {
+	_Atomic unsigned long	 her_seq;
+} __attribute__((aligned(64)));
+
+struct harness_epoch {
+	struct harness_epoch_record	*he_records;
+	int				 he_nrecords;
+};
+
+void harness_epoch_init(struct harness_epoch *, int);
+void harness_epoch_destroy(struct harness_epoch *);
+void harness_epoch_wait(struct harness_epoch *);
+
+static inline void
+harness_epoch_enter(struct harness_epoch_record *her)
+{
+
+	/* Full barrier: the entry is visible before anything is read. */
+	atomic_fetch_add_explicit(&(her->her_seq), 1, memory_order_seq_cst);
+}
+
+static inline void
+harness_epoch_exit(struct harness_epoch_record *her)
+{
+
+	atomic_fetch_add_explicit(&(her->her_seq), 1, memory_order_release);
+}
+
+#define	HARNESS_CHECK(cond) do {					\
+	if (!(cond))							\
+		harness_fail("%s:%d: %s", __FILE__, __LINE__, #cond);	\
+} while (0)
+
+#endif /* !_SECADM_TEST_HARNESS_H_ */
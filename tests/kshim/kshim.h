@@ -0,0 +1,144 @@
+/*-
+ * Copyright (c) 2026 The HardenedBSD Project
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Just enough of the kernel for the module's self-contained sources,
+ * such as secadm_table.c, to build unchanged in userspace.  Every
+ * kernel header they include is a file in this directory that pulls in
+ * this one, and the kernel routines they call map onto libc.
+ */
+
+#ifndef _SECADM_KSHIM_H_
+#define	_SECADM_KSHIM_H_
+
+#include <sys/types.h>
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef MIN
+#define	MIN(a, b)	(((a) < (b)) ? (a) : (b))
+#endif
+#ifndef MAX
+#define	MAX(a, b)	(((a) > (b)) ? (a) : (b))
+#endif
+#ifndef howmany
+#define	howmany(x, y)	(((x) + ((y) - 1)) / (y))
+#endif
+
+#define	M_WAITOK	0x0002
+#define	M_ZERO		0x0100
+
+/* Malloc types only exist for accounting; there is nothing to account. */
+#define	M_SECADM	NULL
+
+static inline void *
+kshim_malloc(size_t size, int flags)
+{
+	void *p;
+
+	if ((p = malloc(size)) == NULL)
+		abort();
+
+	if (flags & M_ZERO)
+		memset(p, 0x00, size);
+
+	return (p);
+}
+
+static inline void *
+kshim_mallocarray(size_t nmemb, size_t size, int flags)
+{
+
+	if (size != 0 && nmemb > SIZE_MAX / size)
+		abort();
+
+	return (kshim_malloc(nmemb * size, flags));
+}
+
+static inline void
+kshim_free(void *p)
+{
+
+	free(p);
+}
+
+static inline void
+kshim_panic(const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	fprintf(stderr, "panic: ");
+	vfprintf(stderr, fmt, ap);
+	fprintf(stderr, "\n");
+	va_end(ap);
+
+	abort();
+}
+
+static inline uint64_t
+kshim_le64dec(const void *pp)
+{
+	const uint8_t *p;
+
+	p = pp;
+
+	return ((uint64_t)p[0] | (uint64_t)p[1] << 8 |
+	    (uint64_t)p[2] << 16 | (uint64_t)p[3] << 24 |
+	    (uint64_t)p[4] << 32 | (uint64_t)p[5] << 40 |
+	    (uint64_t)p[6] << 48 | (uint64_t)p[7] << 56);
+}
+
+static inline int
+kshim_ffsll(long long mask)
+{
+
+	return (__builtin_ffsll(mask));
+}
+
+static inline int
+kshim_flsl(long mask)
+{
+
+	return (mask == 0 ? 0 :
+	    (int)(sizeof(long) * 8) - __builtin_clzl((unsigned long)mask));
+}
+
+#define	malloc(size, type, flags)	kshim_malloc((size), (flags))
+#define	mallocarray(nmemb, size, type, flags)				\
+	kshim_mallocarray((nmemb), (size), (flags))
+#define	free(p, type)			kshim_free(p)
+#define	panic(...)			kshim_panic(__VA_ARGS__)
+#define	le64dec(p)			kshim_le64dec(p)
+#define	ffsll(mask)			kshim_ffsll(mask)
+#define	flsl(mask)			kshim_flsl(mask)
+
+#endif /* !_SECADM_KSHIM_H_ */
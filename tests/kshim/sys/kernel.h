@@ -0,0 +1,2 @@
+/* Kernel header stand-in for the userspace harness; see kshim.h. */
+#include "kshim.h"
@@ -0,0 +1,5 @@
+/* Kernel header stand-in for the userspace harness; see kshim.h. */
+#ifdef __FreeBSD__
+#include_next <sys/mount.h>	/* fsid_t */
+#endif
+#include "kshim.h"
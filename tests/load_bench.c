@@ -0,0 +1,178 @@
+/*-
+ * Copyright (c) 2026 The HardenedBSD Project
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Ruleset load cost against ruleset size.  Loading stages every rule,
+ * finding duplicates with a lookup in the staging index, then builds
+ * the published ruleset with one record per file; both passes are
+ * replayed here on secadm_table, per rule as kernel_add_rule() and
+ * kernel_build_ruleset() do them.  For comparison, the scan of every
+ * staged rule that duplicate detection used to be is timed up to the
+ * size where it stops being bearable.
+ *
+ * The table is the module's own code; the two passes over it are a
+ * model of those functions, without the copyin, path lookup and
+ * allocation around each rule, and have to follow them when they
+ * change.
+ */
+
+#include <sys/types.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "harness.h"
+
+#define	SCAN_MAX	(64 * 1024)
+
+struct rule {
+	secadm_key_t	 r_key;
+	uint64_t	 r_hash;
+};
+
+struct file {
+	secadm_key_t	 f_key;
+	struct rule	*f_rule;
+};
+
+static volatile size_t sink;
+
+static double
+load_table(struct rule *rules, size_t n, double *publish)
+{
+	secadm_table_t staging, published;
+	struct file *files;
+	secadm_key_t key, *k;
+	uint64_t start, hash;
+	size_t i, nfiles, dups;
+	double stage;
+
+	/* Stage: duplicate check and insert, one rule at a time. */
+	start = harness_nsec();
+	secadm_table_init(&staging);
+
+	for (i = dups = 0; i < n; i++) {
+		rules[i].r_hash = secadm_hash(&(rules[i].r_key));
+
+		if (secadm_table_lookup(&staging, &(rules[i].r_key),
+		    rules[i].r_hash) != NULL) {
+			dups++;
+			continue;
+		}
+
+		secadm_table_insert(&staging, &(rules[i].r_key),
+		    rules[i].r_hash);
+	}
+
+	secadm_table_destroy(&staging);
+	stage = (double)(harness_nsec() - start) / n;
+
+	/* Publish: one record per file, keyed without the rule type. */
+	start = harness_nsec();
+	files = calloc(n, sizeof(struct file));
+	secadm_table_init(&published);
+	secadm_table_reserve(&published, n);
+
+	for (i = nfiles = 0; i < n; i++) {
+		key = rules[i].r_key;
+		key.sk_type = 0;
+		hash = secadm_hash(&key);
+
+		if ((k = secadm_table_lookup(&published, &key, hash)) ==
+		    NULL) {
+			files[nfiles].f_key = key;
+			k = &(files[nfiles++].f_key);
+			secadm_table_insert(&published, k, hash);
+		}
+
+		((struct file *)k)->f_rule = &(rules[i]);
+	}
+
+	secadm_table_destroy(&published);
+	free(files);
+	*publish = (double)(harness_nsec() - start) / n;
+
+	sink += dups + nfiles;
+
+	return (stage);
+}
+
+static double
+load_scan(struct rule *rules, size_t n)
+{
+	uint64_t start;
+	size_t i, j, dups;
+
+	start = harness_nsec();
+
+	for (i = dups = 0; i < n; i++) {
+		for (j = 0; j < i; j++) {
+			if (memcmp(&(rules[i].r_key), &(rules[j].r_key),
+			    sizeof(secadm_key_t)) == 0) {
+				dups++;
+				break;
+			}
+		}
+	}
+
+	sink += dups;
+
+	return ((double)(harness_nsec() - start) / n);
+}
+
+int
+main(void)
+{
+	struct rule *rules;
+	double stage, publish;
+	size_t i, n;
+
+	secadm_hash_init();
+
+	printf("%8s  %14s %15s   %14s\n", "rules", "stage ns/rule",
+	    "publish ns/rule", "scan ns/rule");
+
+	for (n = 1000; n <= 1024000; n *= 4) {
+		rules = calloc(n, sizeof(struct rule));
+		for (i = 0; i < n; i++)
+			harness_key(&(rules[i].r_key), i,
+			    secadm_integriforce_rule);
+
+		stage = load_table(rules, n, &publish);
+
+		if (n <= SCAN_MAX)
+			printf("%8zu  %14.1f %15.1f   %14.1f\n", n, stage,
+			    publish, load_scan(rules, n));
+		else
+			printf("%8zu  %14.1f %15.1f   %14s\n", n, stage,
+			    publish, "-");
+
+		free(rules);
+	}
+
+	return (0);
+}
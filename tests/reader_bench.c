@@ -0,0 +1,284 @@
+/*-
+ * Copyright (c) 2026 The HardenedBSD Project
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Exec-path reader scaling: rule lookups from N threads while a writer
+ * republishes the ruleset every WRITER_PERIOD_US.  Two designs:
+ *
+ * sx	Readers take the prison lock shared around the lookup, as
+ *	PE_RLOCK() used to; a pthread rwlock stands in for sx(9).  The
+ *	writer holds it exclusive while it rebuilds the ruleset.
+ * epoch	Readers load the published ruleset inside an epoch section and
+ *	write nothing shared.  The writer builds the new ruleset aside,
+ *	swaps it in and frees the old one after an epoch wait, as
+ *	kernel_publish_ruleset() does.
+ *
+ * Lookups go through the module's secadm_table.c.  The locking around
+ * them is a model: a pthread rwlock and an emulated epoch stand in for
+ * sx(9) and epoch(9), and the ruleset swap follows
+ * kernel_publish_ruleset() by hand.
+ *
+ * Usage: reader_bench [max threads], defaulting to the number of CPUs.
+ */
+
+#include <sys/types.h>
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "harness.h"
+
+#define	NRULES			10000
+#define	RUN_US			1000000
+#define	WRITER_PERIOD_US	10000
+
+enum design {
+	DESIGN_SX,
+	DESIGN_EPOCH
+};
+
+struct ruleset {
+	secadm_table_t	 rs_table;
+	secadm_key_t	*rs_keys;
+};
+
+struct reader {
+	pthread_t	 rd_thread;
+	int		 rd_id;
+	uint64_t	 rd_lookups;
+	uintptr_t	 rd_sink;
+} __attribute__((aligned(64)));
+
+static enum design design;
+static secadm_key_t *keys;
+static pthread_rwlock_t prison_lock;
+static struct ruleset *_Atomic published;
+static struct harness_epoch epoch;
+static atomic_int stop;
+
+static struct ruleset *
+ruleset_build(void)
+{
+	struct ruleset *rs;
+	size_t i;
+
+	rs = malloc(sizeof(struct ruleset));
+	rs->rs_keys = calloc(NRULES, sizeof(secadm_key_t));
+	secadm_table_init(&(rs->rs_table));
+	secadm_table_reserve(&(rs->rs_table), NRULES);
+
+	for (i = 0; i < NRULES; i++) {
+		rs->rs_keys[i] = keys[i];
+		secadm_table_insert(&(rs->rs_table), &(rs->rs_keys[i]),
+		    secadm_hash(&(rs->rs_keys[i])));
+	}
+
+	return (rs);
+}
+
+static void
+ruleset_free(struct ruleset *rs)
+{
+
+	secadm_table_destroy(&(rs->rs_table));
+	free(rs->rs_keys);
+	free(rs);
+}
+
+static void *
+reader_main(void *arg)
+{
+	struct harness_epoch_record *her;
+	struct reader *rd;
+	struct ruleset *rs;
+	secadm_key_t key;
+	uint64_t seed, n;
+	uintptr_t found;
+	int i;
+
+	rd = arg;
+	her = &(epoch.he_records[rd->rd_id]);
+	seed = rd->rd_id + 1;
+	n = 0;
+	found = 0;
+
+	while (!atomic_load_explicit(&stop, memory_order_relaxed)) {
+		for (i = 0; i < 64; i++) {
+			key = keys[harness_random(&seed) % NRULES];
+
+			if (design == DESIGN_SX) {
+				pthread_rwlock_rdlock(&prison_lock);
+				rs = atomic_load_explicit(&published,
+				    memory_order_relaxed);
+				found += (uintptr_t)secadm_table_lookup(
+				    &(rs->rs_table), &key, secadm_hash(&key));
+				pthread_rwlock_unlock(&prison_lock);
+			} else {
+				harness_epoch_enter(her);
+				rs = atomic_load_explicit(&published,
+				    memory_order_acquire);
+				found += (uintptr_t)secadm_table_lookup(
+				    &(rs->rs_table), &key, secadm_hash(&key));
+				harness_epoch_exit(her);
+			}
+		}
+
+		n += 64;
+	}
+
+	/* Per thread, so that no shared line is written. */
+	rd->rd_lookups = n;
+	rd->rd_sink = found;
+
+	return (NULL);
+}
+
+static void *
+writer_main(void *arg)
+{
+	struct ruleset *rs, *old;
+	uint64_t *publishes;
+
+	publishes = arg;
+
+	while (!atomic_load_explicit(&stop, memory_order_relaxed)) {
+		usleep(WRITER_PERIOD_US);
+
+		if (design == DESIGN_SX) {
+			pthread_rwlock_wrlock(&prison_lock);
+			rs = ruleset_build();
+			old = atomic_load_explicit(&published,
+			    memory_order_relaxed);
+			atomic_store_explicit(&published, rs,
+			    memory_order_relaxed);
+			pthread_rwlock_unlock(&prison_lock);
+		} else {
+			rs = ruleset_build();
+			old = atomic_exchange_explicit(&published, rs,
+			    memory_order_acq_rel);
+			harness_epoch_wait(&epoch);
+		}
+
+		ruleset_free(old);
+		(*publishes)++;
+	}
+
+	return (NULL);
+}
+
+/* Lookups per second, summed over nreaders threads. */
+static double
+run(enum design d, int nreaders, int writer)
+{
+	struct reader *readers;
+	pthread_t wthread;
+	uint64_t total, publishes, start, elapsed;
+	int i;
+
+	design = d;
+	atomic_store(&stop, 0);
+	atomic_store(&published, ruleset_build());
+	harness_epoch_init(&epoch, nreaders);
+	readers = aligned_alloc(64, nreaders * sizeof(struct reader));
+	memset(readers, 0x00, nreaders * sizeof(struct reader));
+	publishes = 0;
+
+	start = harness_nsec();
+	for (i = 0; i < nreaders; i++) {
+		readers[i].rd_id = i;
+		pthread_create(&(readers[i].rd_thread), NULL, reader_main,
+		    &(readers[i]));
+	}
+
+	if (writer)
+		pthread_create(&wthread, NULL, writer_main, &publishes);
+
+	usleep(RUN_US);
+	atomic_store(&stop, 1);
+
+	for (i = 0, total = 0; i < nreaders; i++) {
+		pthread_join(readers[i].rd_thread, NULL);
+		total += readers[i].rd_lookups;
+	}
+	elapsed = harness_nsec() - start;
+
+	if (writer)
+		pthread_join(wthread, NULL);
+
+	ruleset_free(atomic_load(&published));
+	harness_epoch_destroy(&epoch);
+	free(readers);
+
+	return ((double)total * 1e9 / elapsed);
+}
+
+int
+main(int argc, char *argv[])
+{
+	int maxthreads, n, writer;
+	size_t i;
+
+	maxthreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	if (argc > 1)
+		maxthreads = atoi(argv[1]);
+	if (maxthreads < 1)
+		maxthreads = 1;
+
+	secadm_hash_init();
+	pthread_rwlock_init(&prison_lock, NULL);
+
+	keys = calloc(NRULES, sizeof(secadm_key_t));
+	for (i = 0; i < NRULES; i++)
+		harness_key(&(keys[i]), i, secadm_integriforce_rule);
+
+	printf("%d rules, million lookups per second\n", NRULES);
+	printf("%8s  %10s %10s   %10s %10s\n", "", "no writer", "",
+	    "writer", "");
+	printf("%8s  %10s %10s   %10s %10s\n", "readers", "sx", "epoch",
+	    "sx", "epoch");
+
+	/* Powers of two, then maxthreads itself. */
+	for (n = 1; ; n = (n * 2 < maxthreads) ? n * 2 : maxthreads) {
+		printf("%8d ", n);
+		for (writer = 0; writer <= 1; writer++)
+			printf(" %10.2f %10.2f  ",
+			    run(DESIGN_SX, n, writer) / 1e6,
+			    run(DESIGN_EPOCH, n, writer) / 1e6);
+		printf("\n");
+
+		if (n == maxthreads)
+			break;
+	}
+
+	pthread_rwlock_destroy(&prison_lock);
+	free(keys);
+
+	return (0);
+}
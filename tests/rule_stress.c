@@ -0,0 +1,400 @@
+/*-
+ * Copyright (c) 2026 The HardenedBSD Project
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Rule lifetime under fire.  Reader threads play the exec hook: inside
+ * an epoch section they look a file up in the published ruleset and
+ * take a reference on its rule, then leave the section and "hash" the
+ * file, reading the rule and updating its verification stamp, before
+ * dropping the reference.  Writer threads meanwhile load, flush, add
+ * and delete rules under the prison lock and republish, freeing each
+ * old ruleset after an epoch wait, with the same reference rules as
+ * kmod/secadm.c: one for the ID table and one per published ruleset.
+ *
+ * Built with AddressSanitizer, any access to a freed rule aborts the
+ * run.  Rules are also marked dead before they are freed and checked
+ * live while referenced, and every rule must be gone at the end.  -u
+ * drops the readers' references, as the exec hook did before rules were
+ * refcounted, and should be caught within a second.
+ *
+ * Only secadm_table.c is the module's own code here.  The rules, their
+ * references, publishing and the verification stamp are a model of
+ * kernel_rule_acquire(), kernel_rule_release(), kernel_publish_ruleset()
+ * and integriforce_verify_get() and _set(), written against the same
+ * protocol, and the epoch is emulated.  What passes is the protocol,
+ * not those functions; a change to how they hand rules around has to
+ * be made here too.
+ *
+ * Usage: rule_stress [-u] [seconds]
+ */
+
+#include <sys/types.h>
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "harness.h"
+
+#define	NREADERS	4
+#define	NWRITERS	2
+#define	NKEYS		512
+#define	DATA_LEN	256
+
+#define	RULE_LIVE	0x11ee11ee
+#define	RULE_DEAD	0xdeaddead
+
+/* As struct secadm_verify, with the file attributes cut to a pair. */
+struct verify {
+	atomic_uint		 v_seq;
+	atomic_int		 v_state;
+	atomic_ulong		 v_size;
+	atomic_ulong		 v_check;	/* ~v_size */
+};
+
+struct rule {
+	secadm_key_t		 r_key;
+	atomic_uint		 r_refs;
+	atomic_uint		 r_magic;
+	struct verify		 r_verify;
+	uint8_t			 r_data[DATA_LEN];
+};
+
+struct file {
+	secadm_key_t		 f_key;
+	struct rule		*f_rule;
+};
+
+struct ruleset {
+	secadm_table_t		 rs_table;
+	struct file		*rs_files;
+	struct rule		**rs_rules;
+	size_t			 rs_nrules;
+};
+
+static pthread_mutex_t prison_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct rule *ids[NKEYS];			/* the ID table */
+static struct ruleset *_Atomic published;
+static struct harness_epoch epoch;
+static atomic_int stop;
+static atomic_long rules_alive;
+static atomic_ulong checks;
+static int unref;
+
+static struct rule *
+rule_alloc(uint64_t n)
+{
+	struct rule *r;
+
+	r = calloc(1, sizeof(struct rule));
+	harness_key(&(r->r_key), n, secadm_integriforce_rule);
+	memset(r->r_data, (int)(n & 0xff), DATA_LEN);
+	atomic_init(&(r->r_refs), 1);
+	atomic_init(&(r->r_magic), RULE_LIVE);
+	atomic_init(&(r->r_verify.v_check), ~0UL);
+	atomic_fetch_add(&rules_alive, 1);
+
+	return (r);
+}
+
+static void
+rule_acquire(struct rule *r)
+{
+
+	HARNESS_CHECK(atomic_fetch_add(&(r->r_refs), 1) > 0);
+}
+
+static void
+rule_release(struct rule *r)
+{
+
+	if (atomic_fetch_sub_explicit(&(r->r_refs), 1,
+	    memory_order_acq_rel) == 1) {
+		atomic_store(&(r->r_magic), RULE_DEAD);
+		free(r);
+		atomic_fetch_sub(&rules_alive, 1);
+	}
+}
+
+/* integriforce_verify_get(): a consistent snapshot or nothing. */
+static int
+verify_get(struct verify *v, unsigned long *size)
+{
+	unsigned long check;
+	u_int seq;
+	int state;
+
+	seq = atomic_load_explicit(&(v->v_seq), memory_order_acquire);
+	if (seq & 1)
+		return (0);
+
+	state = atomic_load_explicit(&(v->v_state), memory_order_relaxed);
+	*size = atomic_load_explicit(&(v->v_size), memory_order_relaxed);
+	check = atomic_load_explicit(&(v->v_check), memory_order_relaxed);
+
+	atomic_thread_fence(memory_order_acquire);
+	if (atomic_load_explicit(&(v->v_seq), memory_order_relaxed) != seq)
+		return (0);
+
+	HARNESS_CHECK(check == ~*size);
+
+	return (state);
+}
+
+/* integriforce_verify_set(): one writer at a time, losers skip. */
+static void
+verify_set(struct verify *v, unsigned long size)
+{
+	u_int seq;
+
+	seq = atomic_load_explicit(&(v->v_seq), memory_order_relaxed);
+	if ((seq & 1) || !atomic_compare_exchange_strong_explicit(
+	    &(v->v_seq), &seq, seq + 1, memory_order_acquire,
+	    memory_order_relaxed))
+		return;
+
+	atomic_store_explicit(&(v->v_state), 1, memory_order_relaxed);
+	atomic_store_explicit(&(v->v_size), size, memory_order_relaxed);
+	atomic_store_explicit(&(v->v_check), ~size, memory_order_relaxed);
+
+	atomic_store_explicit(&(v->v_seq), seq + 2, memory_order_release);
+}
+
+/*
+ * kernel_build_ruleset(): one record per file with a rule in the ID
+ * table, and a reference on each rule.  Called with the prison lock.
+ */
+static struct ruleset *
+ruleset_build(void)
+{
+	struct ruleset *rs;
+	size_t i;
+
+	rs = calloc(1, sizeof(struct ruleset));
+	rs->rs_files = calloc(NKEYS, sizeof(struct file));
+	rs->rs_rules = calloc(NKEYS, sizeof(struct rule *));
+	secadm_table_init(&(rs->rs_table));
+
+	for (i = 0; i < NKEYS; i++) {
+		if (ids[i] == NULL)
+			continue;
+
+		rule_acquire(ids[i]);
+		rs->rs_files[rs->rs_nrules].f_key = ids[i]->r_key;
+		rs->rs_files[rs->rs_nrules].f_rule = ids[i];
+		rs->rs_rules[rs->rs_nrules] = ids[i];
+		secadm_table_insert(&(rs->rs_table),
+		    &(rs->rs_files[rs->rs_nrules].f_key),
+		    secadm_hash(&(ids[i]->r_key)));
+		rs->rs_nrules++;
+	}
+
+	return (rs);
+}
+
+static void
+ruleset_free(struct ruleset *rs)
+{
+	size_t i;
+
+	for (i = 0; i < rs->rs_nrules; i++)
+		rule_release(rs->rs_rules[i]);
+
+	secadm_table_destroy(&(rs->rs_table));
+	free(rs->rs_rules);
+	free(rs->rs_files);
+	free(rs);
+}
+
+/* kernel_publish_ruleset() */
+static void
+publish(void)
+{
+	struct ruleset *old;
+
+	old = atomic_exchange_explicit(&published, ruleset_build(),
+	    memory_order_acq_rel);
+	harness_epoch_wait(&epoch);
+	ruleset_free(old);
+}
+
+static void
+id_set(size_t i, struct rule *r)
+{
+
+	if (ids[i] != NULL)
+		rule_release(ids[i]);
+
+	ids[i] = r;
+}
+
+static void *
+writer_main(void *arg)
+{
+	uint64_t seed, r;
+	size_t i;
+
+	seed = (uintptr_t)arg;
+
+	while (!atomic_load_explicit(&stop, memory_order_relaxed)) {
+		r = harness_random(&seed);
+		i = (size_t)(r >> 8) % NKEYS;
+
+		pthread_mutex_lock(&prison_lock);
+		switch (r & 3) {
+		case 0:		/* load: a whole new set of rules */
+			for (i = 0; i < NKEYS; i++)
+				id_set(i, rule_alloc(i));
+			break;
+		case 1:		/* flush */
+			for (i = 0; i < NKEYS; i++)
+				id_set(i, NULL);
+			break;
+		case 2:		/* add */
+			if (ids[i] == NULL)
+				id_set(i, rule_alloc(i));
+			break;
+		default:	/* delete */
+			id_set(i, NULL);
+			break;
+		}
+		publish();
+		pthread_mutex_unlock(&prison_lock);
+	}
+
+	return (NULL);
+}
+
+static void *
+reader_main(void *arg)
+{
+	struct harness_epoch_record *her;
+	struct ruleset *rs;
+	struct rule *r;
+	secadm_key_t key, *k;
+	unsigned long size, sum;
+	uint64_t seed;
+	size_t i;
+
+	her = &(epoch.he_records[(uintptr_t)arg]);
+	seed = (uintptr_t)arg + 1000;
+
+	while (!atomic_load_explicit(&stop, memory_order_relaxed)) {
+		/* Half of the keys never have a rule. */
+		harness_key(&key, harness_random(&seed) % (NKEYS * 2),
+		    secadm_integriforce_rule);
+
+		harness_epoch_enter(her);
+		rs = atomic_load_explicit(&published, memory_order_acquire);
+		r = NULL;
+		if ((k = secadm_table_lookup(&(rs->rs_table), &key,
+		    secadm_hash(&key))) != NULL) {
+			r = ((struct file *)k)->f_rule;
+			if (!unref)
+				rule_acquire(r);
+		}
+		harness_epoch_exit(her);
+
+		if (r == NULL)
+			continue;
+
+		/* Outside the section, as integriforce_verify() hashes. */
+		HARNESS_CHECK(atomic_load(&(r->r_magic)) == RULE_LIVE);
+		verify_get(&(r->r_verify), &size);
+		for (i = sum = 0; i < DATA_LEN; i++)
+			sum += r->r_data[i];
+		verify_set(&(r->r_verify), sum);
+		HARNESS_CHECK(atomic_load(&(r->r_magic)) == RULE_LIVE);
+
+		if (!unref)
+			rule_release(r);
+		atomic_fetch_add_explicit(&checks, 1, memory_order_relaxed);
+	}
+
+	return (NULL);
+}
+
+int
+main(int argc, char *argv[])
+{
+	pthread_t readers[NREADERS], writers[NWRITERS];
+	int ch, seconds;
+	size_t i;
+
+	while ((ch = getopt(argc, argv, "u")) != -1) {
+		switch (ch) {
+		case 'u':
+			unref = 1;
+			break;
+		default:
+			fprintf(stderr, "usage: rule_stress [-u] [seconds]\n");
+			return (2);
+		}
+	}
+
+	seconds = (optind < argc) ? atoi(argv[optind]) : 2;
+
+	secadm_hash_init();
+	harness_epoch_init(&epoch, NREADERS);
+
+	pthread_mutex_lock(&prison_lock);
+	atomic_store(&published, ruleset_build());
+	pthread_mutex_unlock(&prison_lock);
+
+	for (i = 0; i < NREADERS; i++)
+		pthread_create(&(readers[i]), NULL, reader_main,
+		    (void *)(uintptr_t)i);
+	for (i = 0; i < NWRITERS; i++)
+		pthread_create(&(writers[i]), NULL, writer_main,
+		    (void *)(uintptr_t)(i + 1));
+
+	sleep(seconds);
+	atomic_store(&stop, 1);
+
+	for (i = 0; i < NREADERS; i++)
+		pthread_join(readers[i], NULL);
+	for (i = 0; i < NWRITERS; i++)
+		pthread_join(writers[i], NULL);
+
+	/* Flush, then the last ruleset goes with no reader left. */
+	pthread_mutex_lock(&prison_lock);
+	for (i = 0; i < NKEYS; i++)
+		id_set(i, NULL);
+	publish();
+	pthread_mutex_unlock(&prison_lock);
+	ruleset_free(atomic_load(&published));
+
+	HARNESS_CHECK(atomic_load(&rules_alive) == 0);
+	harness_epoch_destroy(&epoch);
+
+	printf("rule_stress: ok, %lu checks of a referenced rule\n",
+	    (unsigned long)atomic_load(&checks));
+
+	return (0);
+}
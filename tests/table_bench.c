@@ -0,0 +1,190 @@
+/*-
+ * Copyright (c) 2026 The HardenedBSD Project
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Rule lookup cost: secadm_table against the red-black tree it replaced,
+ * which was ordered on a 32-bit FNV hash of the key alone.  Both sides
+ * hash a key built on the stack and look it up, as the exec hook does.
+ * tsearch(3) stands in for the tree(3) macros, which glibc lacks; it is
+ * a red-black tree there too.  The tree side also counts the rules its
+ * key silently lost to FNV collisions.
+ */
+
+#include <sys/types.h>
+
+#include <search.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "harness.h"
+
+#define	NLOOKUPS	2000000
+
+struct rule {
+	secadm_key_t	 r_key;
+	uint32_t	 r_fnv;
+};
+
+static volatile uintptr_t sink;
+
+static int
+rule_cmp(const void *a, const void *b)
+{
+	const struct rule *ra, *rb;
+
+	ra = a;
+	rb = b;
+
+	if (ra->r_fnv < rb->r_fnv)
+		return (-1);
+
+	if (ra->r_fnv > rb->r_fnv)
+		return (1);
+
+	return (0);
+}
+
+static double
+per_op(uint64_t start, size_t n)
+{
+
+	return ((double)(harness_nsec() - start) / n);
+}
+
+static void
+bench(size_t n)
+{
+	secadm_table_t table;
+	struct rule *rules, probe;
+	secadm_key_t key, *k;
+	size_t i, *order, collisions;
+	uint64_t seed, start;
+	double t_ins, t_hit, t_miss, r_ins, r_hit, r_miss;
+	void *root, **node;
+
+	rules = calloc(n, sizeof(struct rule));
+	order = calloc(NLOOKUPS, sizeof(size_t));
+
+	for (i = 0; i < n; i++) {
+		harness_key(&(rules[i].r_key), i, secadm_integriforce_rule);
+		rules[i].r_fnv = harness_fnv32(&(rules[i].r_key),
+		    sizeof(secadm_key_t));
+	}
+
+	seed = n;
+	for (i = 0; i < NLOOKUPS; i++)
+		order[i] = (size_t)(harness_random(&seed) % n);
+
+	/* secadm_table */
+	secadm_table_init(&table);
+
+	start = harness_nsec();
+	for (i = 0; i < n; i++)
+		secadm_table_insert(&table, &(rules[i].r_key),
+		    secadm_hash(&(rules[i].r_key)));
+	t_ins = per_op(start, n);
+
+	start = harness_nsec();
+	for (i = 0; i < NLOOKUPS; i++) {
+		key = rules[order[i]].r_key;
+		k = secadm_table_lookup(&table, &key, secadm_hash(&key));
+		sink += (uintptr_t)k;
+	}
+	t_hit = per_op(start, NLOOKUPS);
+
+	start = harness_nsec();
+	for (i = 0; i < NLOOKUPS; i++) {
+		harness_key(&key, n + order[i], secadm_integriforce_rule);
+		k = secadm_table_lookup(&table, &key, secadm_hash(&key));
+		sink += (uintptr_t)k;
+	}
+	t_miss = per_op(start, NLOOKUPS);
+
+	secadm_table_destroy(&table);
+
+	/* The old tree */
+	root = NULL;
+	collisions = 0;
+
+	start = harness_nsec();
+	for (i = 0; i < n; i++) {
+		node = tsearch(&(rules[i]), &root, rule_cmp);
+		if (*node != &(rules[i]))
+			collisions++;
+	}
+	r_ins = per_op(start, n);
+
+	start = harness_nsec();
+	for (i = 0; i < NLOOKUPS; i++) {
+		probe.r_key = rules[order[i]].r_key;
+		probe.r_fnv = harness_fnv32(&(probe.r_key),
+		    sizeof(secadm_key_t));
+		node = tfind(&probe, &root, rule_cmp);
+		sink += (uintptr_t)node;
+	}
+	r_hit = per_op(start, NLOOKUPS);
+
+	start = harness_nsec();
+	for (i = 0; i < NLOOKUPS; i++) {
+		harness_key(&(probe.r_key), n + order[i],
+		    secadm_integriforce_rule);
+		probe.r_fnv = harness_fnv32(&(probe.r_key),
+		    sizeof(secadm_key_t));
+		node = tfind(&probe, &root, rule_cmp);
+		sink += (uintptr_t)node;
+	}
+	r_miss = per_op(start, NLOOKUPS);
+
+	for (i = 0; i < n; i++)
+		tdelete(&(rules[i]), &root, rule_cmp);
+
+	printf("%8zu  %7.1f %7.1f %7.1f   %7.1f %7.1f %7.1f   %zu\n", n,
+	    t_ins, t_hit, t_miss, r_ins, r_hit, r_miss, collisions);
+
+	free(order);
+	free(rules);
+}
+
+int
+main(void)
+{
+	size_t n;
+
+	secadm_hash_init();
+
+	printf("ns per operation\n");
+	printf("%8s  %23s   %23s   %s\n", "", "secadm_table",
+	    "rb tree on fnv32", "");
+	printf("%8s  %7s %7s %7s   %7s %7s %7s   %s\n", "rules",
+	    "insert", "hit", "miss", "insert", "hit", "miss",
+	    "lost to collisions");
+
+	for (n = 1000; n <= 1000000; n *= 10)
+		bench(n);
+
+	return (0);
+}
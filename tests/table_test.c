@@ -0,0 +1,277 @@
+/*-
+ * Copyright (c) 2026 The HardenedBSD Project
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * secadm_table.c against a trivially correct model: random inserts,
+ * removes and lookups, with every key checked along the way, including
+ * while a grow is still migrating the old generation.  Built with
+ * AddressSanitizer and UBSan by the Makefile.
+ */
+
+#include <sys/types.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "harness.h"
+
+struct object {
+	secadm_key_t	 o_key;
+	uint64_t	 o_hash;
+	int		 o_present;
+};
+
+static void
+test_siphash(void)
+{
+	static const uint8_t vkey[16] = {
+		0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+		0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f
+	};
+	uint8_t msg[15];
+	size_t i;
+
+	/* The reference implementation's vector for a 15-byte input. */
+	for (i = 0; i < sizeof(msg); i++)
+		msg[i] = (uint8_t)i;
+
+	HARNESS_CHECK(harness_siphash24(vkey, msg, sizeof(msg)) ==
+	    0xa129ca6149be45e5ULL);
+}
+
+static void
+test_identity(void)
+{
+	secadm_table_t table;
+	secadm_key_t a, b, c, probe;
+	int32_t fsid[2];
+
+	secadm_table_init(&table);
+
+	/* Same fsid and fileid, different type. */
+	harness_key(&a, 1, secadm_pax_rule);
+	harness_key(&b, 1, secadm_integriforce_rule);
+
+	/* Same fileid and type, different file system. */
+	harness_key(&c, 1, secadm_pax_rule);
+	memcpy(fsid, &(c.sk_fsid), sizeof(fsid));
+	fsid[1]++;
+	memcpy(&(c.sk_fsid), fsid, sizeof(fsid));
+
+	secadm_table_insert(&table, &a, secadm_hash(&a));
+	secadm_table_insert(&table, &b, secadm_hash(&b));
+	secadm_table_insert(&table, &c, secadm_hash(&c));
+
+	probe = a;
+	HARNESS_CHECK(secadm_table_lookup(&table, &probe,
+	    secadm_hash(&probe)) == &a);
+	probe = b;
+	HARNESS_CHECK(secadm_table_lookup(&table, &probe,
+	    secadm_hash(&probe)) == &b);
+	probe = c;
+	HARNESS_CHECK(secadm_table_lookup(&table, &probe,
+	    secadm_hash(&probe)) == &c);
+
+	secadm_table_remove(&table, &b, secadm_hash(&b));
+	probe = b;
+	HARNESS_CHECK(secadm_table_lookup(&table, &probe,
+	    secadm_hash(&probe)) == NULL);
+	HARNESS_CHECK(table.st_count == 2);
+
+	secadm_table_destroy(&table);
+}
+
+static void
+check_all(secadm_table_t *table, struct object *objs, size_t n)
+{
+	secadm_key_t probe;
+	size_t i, count;
+
+	for (i = count = 0; i < n; i++) {
+		probe = objs[i].o_key;
+		HARNESS_CHECK(secadm_table_lookup(table, &probe,
+		    objs[i].o_hash) ==
+		    (objs[i].o_present ? &(objs[i].o_key) : NULL));
+		count += objs[i].o_present;
+	}
+
+	HARNESS_CHECK(table->st_count == count);
+}
+
+/*
+ * Random operations on n objects.  Every so often the whole table is
+ * compared against the model, and the run must have seen a migration in
+ * progress at least once.
+ */
+static void
+test_random(size_t n, size_t nops, uint64_t mask, uint64_t seed)
+{
+	secadm_table_t table;
+	struct object *objs;
+	secadm_key_t probe;
+	size_t i, op, migrating;
+	uint64_t r;
+
+	harness_hash_mask = mask;
+
+	objs = calloc(n, sizeof(struct object));
+	for (i = 0; i < n; i++) {
+		harness_key(&(objs[i].o_key), i, (i & 1) ?
+		    secadm_integriforce_rule : secadm_pax_rule);
+		objs[i].o_hash = secadm_hash(&(objs[i].o_key));
+	}
+
+	secadm_table_init(&table);
+	migrating = 0;
+
+	for (op = 0; op < nops; op++) {
+		r = harness_random(&seed);
+		i = (size_t)(r >> 8) % n;
+
+		/* Bias towards inserts so that the table keeps growing. */
+		switch (r & 7) {
+		case 0:
+		case 1:
+		case 2:
+			if (!objs[i].o_present) {
+				secadm_table_insert(&table, &(objs[i].o_key),
+				    objs[i].o_hash);
+				objs[i].o_present = 1;
+			}
+			break;
+		case 3:
+		case 4:
+			if (objs[i].o_present) {
+				secadm_table_remove(&table, &(objs[i].o_key),
+				    objs[i].o_hash);
+				objs[i].o_present = 0;
+			}
+			break;
+		default:
+			probe = objs[i].o_key;
+			HARNESS_CHECK(secadm_table_lookup(&table, &probe,
+			    objs[i].o_hash) ==
+			    (objs[i].o_present ? &(objs[i].o_key) : NULL));
+			break;
+		}
+
+		if (table.st_old.stg_ngroups != 0)
+			migrating++;
+
+		if (op % (nops / 16) == 0)
+			check_all(&table, objs, n);
+	}
+
+	check_all(&table, objs, n);
+	HARNESS_CHECK(migrating > 0);
+
+	secadm_table_destroy(&table);
+	free(objs);
+
+	harness_hash_mask = ~(uint64_t)0;
+}
+
+/* Lookups of every key inserted so far, across each grow. */
+static void
+test_grow(size_t n)
+{
+	secadm_table_t table;
+	struct object *objs;
+	secadm_key_t probe;
+	size_t i, j;
+
+	objs = calloc(n, sizeof(struct object));
+	secadm_table_init(&table);
+
+	for (i = 0; i < n; i++) {
+		harness_key(&(objs[i].o_key), i, secadm_integriforce_rule);
+		objs[i].o_hash = secadm_hash(&(objs[i].o_key));
+		secadm_table_insert(&table, &(objs[i].o_key), objs[i].o_hash);
+		objs[i].o_present = 1;
+
+		if (table.st_old.stg_ngroups == 0)
+			continue;
+
+		for (j = 0; j <= i; j++) {
+			probe = objs[j].o_key;
+			HARNESS_CHECK(secadm_table_lookup(&table, &probe,
+			    objs[j].o_hash) == &(objs[j].o_key));
+		}
+	}
+
+	check_all(&table, objs, n);
+	secadm_table_destroy(&table);
+	free(objs);
+}
+
+/* A reserved table takes its keys without ever growing. */
+static void
+test_reserve(size_t n)
+{
+	secadm_table_t table;
+	struct object *objs;
+	size_t i, ngroups;
+
+	objs = calloc(n, sizeof(struct object));
+	secadm_table_init(&table);
+	secadm_table_reserve(&table, n);
+	ngroups = table.st_cur.stg_ngroups;
+
+	for (i = 0; i < n; i++) {
+		harness_key(&(objs[i].o_key), i, secadm_integriforce_rule);
+		objs[i].o_hash = secadm_hash(&(objs[i].o_key));
+		secadm_table_insert(&table, &(objs[i].o_key), objs[i].o_hash);
+		objs[i].o_present = 1;
+	}
+
+	HARNESS_CHECK(table.st_cur.stg_ngroups == ngroups);
+	HARNESS_CHECK(table.st_old.stg_ngroups == 0);
+
+	check_all(&table, objs, n);
+	secadm_table_destroy(&table);
+	free(objs);
+}
+
+int
+main(void)
+{
+
+	secadm_hash_init();
+
+	test_siphash();
+	test_identity();
+	test_grow(3000);
+	test_reserve(100000);
+	test_random(20000, 400000, ~(uint64_t)0, 1);
+	/* Few distinct hashes: long probe chains through DELETED slots. */
+	test_random(4000, 200000, 0xfff, 2);
+	test_random(4000, 200000, 0x7f, 3);
+
+	printf("table_test: ok\n");
+
+	return (0);
+}